@@ -4,9 +4,20 @@
 #include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 #include "vector_helper.h"
 #include "shape.h"
 
+#if defined(__SSE__) || defined(_M_X64)
+#define BVH4_SSE
+#include <xmmintrin.h>
+#endif
+
 /*
 ==================================================================================================
 The acceleration hierarchy speeds up the rendering process by vastly reducing the number of
@@ -14,116 +25,1601 @@ intersections required to test for as the number of shapes in a scene increases.
 ==================================================================================================
 */
 
-// BVH Node
+const int BVH_MAX_LEAF_SIZE = 4;       //default number of shapes a leaf may hold before the builders are forced to split it
+const int BVH_LEAF_SIZE_LIMIT = 65535; //primCount is 16 bits in the flattened nodes
+const double BVH_REFIT_THRESHOLD = 1.5; //a refitted tree is thrown away once its SAH cost passes this many times its cost when built
+
+// BVH Node; only used while building, the renderer traverses the flattened LinearBVH below
+// Leaves reference a range of the primitive index array, which in turn indexes the scene's shape list.
 struct BVHNode {
     Cube bounds;
     BVHNode* left;
     BVHNode* right;
-    Shape* shape;
+    int firstPrim; //first entry of the primitive index array covered by a leaf
+    int primCount; //number of shapes in a leaf; 0 for interior nodes
+    int axis;      //the axis the children were split along
+    double cost;   //SAH cost of the subtree; scratch space for the treelet restructuring pass
+
+    BVHNode(const Cube& _bounds) : bounds(_bounds), left(nullptr), right(nullptr), firstPrim(0), primCount(0), axis(0), cost(0) {}
+
+    bool isLeaf () const { return primCount > 0; }
+};
+
+BVHNode* makeBVHLeaf (const Cube& bounds, int firstPrim, int primCount) {
+    BVHNode* leafNode = new BVHNode(bounds);
+    leafNode->firstPrim = firstPrim;
+    leafNode->primCount = primCount;
+    return leafNode;
+}
+
+/*
+Flattened BVH node -> the tree is stored depth-first in one array, so the left child of a node is always the next node along.
+Each one is exactly 32 bytes (two nodes per cache line!) instead of a whole Cube, Material and texture per node.
+*/
+struct LinearBVHNode {
+    float minimums[3];
+    float maximums[3];
+    int32_t offset;     //leaf: index of the first primitive | interior: index of the right child
+    uint16_t primCount; //0 for interior nodes
+    uint16_t axis;      //split axis of interior nodes
+
+    //slab test against the (padded) bounds of the node; only the part of the box within the ray's tMin - tMax counts.
+    //the ray's sign bits pick the near & far planes, so it's all multiplies.
+    //a ray parallel to a slab & starting exactly on its plane gives 0 * inf = NaN, which fails both comparisons below and
+    //leaves the interval alone - so the test errs towards a hit, never a miss
+    bool intersect (const Ray& ray) const {
+        const vector3& invDirection = ray.getInvDirection();
+        vector3 origin = ray.getOrigin();
+        double rayMin = ray.getTMin();
+        double rayMax = ray.getTMax();
+        for (int a = 0; a < 3; a++) {
+            double t0 = ((ray.getSign(a) ? maximums[a] : minimums[a]) - origin.atr[a]) * invDirection.atr[a];
+            double t1 = ((ray.getSign(a) ? minimums[a] : maximums[a]) - origin.atr[a]) * invDirection.atr[a];
+            if (t0 > rayMin) { rayMin = t0; }
+            if (t1 < rayMax) { rayMax = t1; }
+            if (rayMax < rayMin) { return false; }
+        }
+        return true;
+    }
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+class LinearBVH {
+    public:
+        std::vector<LinearBVHNode> nodes;
+        std::vector<Shape*> prims; //primitives in leaf order; leaves reference a range of this
+        std::vector<int> primOrder; //where each of prims sits in the scene's shape list; lets a refit pick up a new frame's shapes
+        int maxDepth;              //deepest leaf; sizes the traversal stack
+        double builtCost;          //SAH cost straight after building; refits are judged against it
+
+        LinearBVH () : maxDepth(0), builtCost(0) {}
+        //shapes & primIndices are the shape list and primitive index array the tree was built over
+        LinearBVH (BVHNode* root, const std::vector<Shape*>& shapes, const std::vector<int>& primIndices) : maxDepth(0), builtCost(0) {
+            prims.reserve(primIndices.size());
+            primOrder.reserve(primIndices.size());
+            if (root) { flatten(root, shapes, primIndices, 0); }
+        }
+
+        //true if shapes could be dropped into this tree in place of the shapes it was built over (same count, same types);
+        //never the case for trees that reference some shapes more than once (spatial splits), as their leaves were cut to fit
+        //trees written out by a DynamicBVH (live edits) match the edited shape list, DynamicBVH::shapes()
+        bool sameTopology (const std::vector<Shape*>& shapes) const {
+            if (shapes.size() != prims.size() || primOrder.size() != prims.size()) { return false; }
+            for (int i = 0; i < (int) prims.size(); i++) {
+                if (prims[i]->getType() != shapes[primOrder[i]]->getType()) { return false; }
+            }
+            return true;
+        }
+
+        /*
+        Swaps in a new frame's shapes (see sameTopology) and refits every box around them, keeping the tree as it is.
+        Children are always stored after their parent, so walking the array backwards visits both children before the parent.
+        */
+        void refit (const std::vector<Shape*>& shapes) {
+            for (int i = 0; i < (int) prims.size(); i++) { prims[i] = shapes[primOrder[i]]; }
+
+            for (int index = nodes.size() - 1; index >= 0; index--) {
+                LinearBVHNode& node = nodes[index];
+                if (node.primCount > 0) {
+                    vector3 mi = prims[node.offset]->getMinimums();
+                    vector3 ma = prims[node.offset]->getMaximums();
+                    for (int i = node.offset + 1; i < node.offset + node.primCount; i++) {
+                        mi = vectMin(mi, prims[i]->getMinimums());
+                        ma = vectMax(ma, prims[i]->getMaximums());
+                    }
+                    setBounds(node, mi, ma);
+                }
+                else {
+                    const LinearBVHNode& left = nodes[index + 1];
+                    const LinearBVHNode& right = nodes[node.offset];
+                    for (int a = 0; a < 3; a++) {
+                        node.minimums[a] = std::min(left.minimums[a], right.minimums[a]);
+                        node.maximums[a] = std::max(left.maximums[a], right.maximums[a]);
+                    }
+                }
+            }
+        }
 
-    BVHNode(const Cube& _bounds) : bounds(_bounds), left(nullptr), right(nullptr), shape(nullptr) {}
+        //gives node the (padded, rounded outwards) box mi -> ma
+        static void setBounds (LinearBVHNode& node, const vector3& mi, const vector3& ma) {
+            for (int a = 0; a < 3; a++) {
+                node.minimums[a] = floatBelow(mi.atr[a] - BOUNDS_PADDING);
+                node.maximums[a] = floatAbove(ma.atr[a] + BOUNDS_PADDING);
+            }
+        }
+
+    private:
+        //the nudge Cube used to apply per ray (and then per camera position); done once here for every box, so rays
+        //starting on or grazing a face (the camera, shadow rays off a triangle) still get in. The builders leave boxes tight,
+        //so the tree doesn't depend on where the camera is and never changes while rendering
+        static constexpr double BOUNDS_PADDING = 0.001;
+
+        //round outwards when going down to floats so the boxes never shrink
+        static float floatBelow (double d) { float f = (float) d; return (f > d) ? std::nextafter(f, -INFINITY) : f; }
+        static float floatAbove (double d) { float f = (float) d; return (f < d) ? std::nextafter(f, INFINITY) : f; }
+
+        int flatten (BVHNode* node, const std::vector<Shape*>& shapes, const std::vector<int>& primIndices, int depth) {
+            int index = nodes.size();
+            maxDepth = std::max(maxDepth, depth);
+            nodes.push_back(LinearBVHNode());
+
+            LinearBVHNode linear;
+            setBounds(linear, node->bounds.getMinimums(), node->bounds.getMaximums());
+
+            if (node->isLeaf()) {
+                //resolve the leaf's index range into pointers, so traversal walks a contiguous run of shapes
+                linear.offset = prims.size();
+                linear.primCount = node->primCount;
+                linear.axis = 0;
+                for (int i = node->firstPrim; i < node->firstPrim + node->primCount; i++) {
+                    prims.push_back(shapes[primIndices[i]]);
+                    primOrder.push_back(primIndices[i]);
+                }
+            }
+            else {
+                linear.primCount = 0;
+                linear.axis = node->axis;
+                flatten(node->left, shapes, primIndices, depth + 1);
+                linear.offset = flatten(node->right, shapes, primIndices, depth + 1);
+            }
+
+            nodes[index] = linear; //can't hold a reference over the recursion; the vector may have moved
+            return index;
+        }
 };
 
-// Function to traverse the BVH and find the closest intersection
-Hit intersectBVH(vector3 camPos, Ray& ray, const std::list<LightSource*>& l, const vector3& look, BVHNode* node, bool calcMaterial = true, bool toplayer = false) {
-    if (!node) {
+const int BVH_STACK_SIZE = 64; //plenty for any sensibly built tree; deeper trees get a heap allocated stack
+
+/*
+Function to traverse the BVH and find the closest intersection.
+Walks the node array with an explicit stack, visiting the nearer child first (based on the sign of the ray direction along
+the split axis), and skips any node the ray enters beyond the closest hit found so far.
+Shapes are only asked for a distance during the walk; returns the closest shape (or nullptr), and pulls the ray's tMax in to
+its distance. Only hits within the ray's interval count, so tMax can come in set to a limit too.
+findClosestFrom() walks just the subtree under node root, keeping closestShape (a hit at the ray's tMax) unless it finds closer;
+packets of rays (ray_packet.h) hand their lanes over to it once they've split up.
+*/
+Shape* findClosestFrom (const LinearBVH* bvh, Ray& ray, int root, Shape* closestShape, int& checks) {
+    int stackBuffer[BVH_STACK_SIZE];
+    std::vector<int> bigStack;
+    int* stack = stackBuffer;
+    if (bvh->maxDepth >= BVH_STACK_SIZE) {
+        bigStack.resize(bvh->maxDepth + 1);
+        stack = bigStack.data();
+    }
+    int stackSize = 0;
+    int index = root;
+
+    while (true) {
+        const LinearBVHNode& node = bvh->nodes[index];
+        checks++;
+
+        if (node.intersect(ray)) {
+            if (node.primCount > 0) {
+                for (int i = node.offset; i < node.offset + node.primCount; i++) {
+                    double t = bvh->prims[i]->hitDistance(ray);
+                    if (t >= 0 && (!closestShape || t < ray.getTMax())) { //ties go to the shape found first
+                        ray.setTMax(t);
+                        closestShape = bvh->prims[i];
+                    }
+                }
+            }
+            else {
+                //left child sits straight after its parent, right child is at offset
+                if (ray.getSign(node.axis)) {
+                    stack[stackSize++] = index + 1;
+                    index = node.offset;
+                }
+                else {
+                    stack[stackSize++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stackSize == 0) { break; }
+        index = stack[--stackSize];
+    }
+
+    return closestShape;
+}
+
+Shape* findClosest (const LinearBVH* bvh, Ray& ray, int& checks) {
+    if (!bvh || bvh->nodes.empty()) { return nullptr; }
+    return findClosestFrom(bvh, ray, 0, nullptr, checks);
+}
+
+// Unshaded queries (calcMaterial off) come from secondary rays, which skip the first RAY_EPSILON to miss their own surface
+void guardSecondaryRay (Ray& ray, bool calcMaterial) {
+    if (!calcMaterial) { ray.setInterval(std::max(ray.getTMin(), RAY_EPSILON), ray.getTMax()); }
+}
+
+// The full (shaded) Hit for the closest shape along the ray; only the winner of findClosest() ever gets shaded
+Hit intersectBVH(Ray& ray, const std::list<LightSource*>& l, const vector3& look, const LinearBVH* bvh, bool calcMaterial = true) {
+    if (!bvh || bvh->nodes.empty()) {
         Hit h = Hit();
         h.setChecks(1);
         return h;
     }
 
-    //check intersection with shape in bounding box, if it exists
-    if (node->shape && node->shape->getType() != "null") {
-        Hit h = node->shape->intersect(ray, l, look, calcMaterial);
-        h.setChecks(1);
+    guardSecondaryRay(ray, calcMaterial);
+    int checks = 0; //debugging acceleration only
+    Shape* closestShape = findClosest(bvh, ray, checks);
+
+    if (!closestShape) {
+        Hit h = Hit();
+        h.setChecks(checks);
         return h;
     }
 
-    //check intersection with bounding box
-    if (node->bounds.intersect(ray, l, look, calcMaterial).getT() <= 0) { 
-        //std::cout << "Didn't collide with this boundary! (" << node->bounds.getCenter().x() << "," << node->bounds.getCenter().y() << "," << node->bounds.getCenter().z() << "]" << std::endl;
+    Hit h = closestShape->intersect(ray, l, look, calcMaterial);
+    h.setChecks(checks);
+    return h;
+}
+
+/*
+Any-hit query for shadow rays: returns the first shape found within the ray's interval (or nullptr if the way is clear); the
+caller sets that to run from just off the surface up to the light.
+No closest-hit bookkeeping, no normals, and no shading; the walk stops on the first blocker.
+The shape with id ignoreID (the one being shaded, through instance ignoreInstanceID if it's part of one) never counts as a blocker.
+*/
+Shape* findOccluder (const LinearBVH* bvh, Ray& ray, int ignoreID, int ignoreInstanceID = -1) {
+    if (!bvh || bvh->nodes.empty()) { return nullptr; }
+
+    int stackBuffer[BVH_STACK_SIZE];
+    std::vector<int> bigStack;
+    int* stack = stackBuffer;
+    if (bvh->maxDepth >= BVH_STACK_SIZE) {
+        bigStack.resize(bvh->maxDepth + 1);
+        stack = bigStack.data();
+    }
+    int stackSize = 0;
+    int index = 0;
+
+    while (true) {
+        const LinearBVHNode& node = bvh->nodes[index];
+
+        if (node.intersect(ray)) {
+            if (node.primCount > 0) {
+                for (int i = node.offset; i < node.offset + node.primCount; i++) {
+                    Shape* s = bvh->prims[i];
+                    if (s->occludes(ray, ignoreID, ignoreInstanceID)) { return s; }
+                }
+            }
+            else {
+                if (ray.getSign(node.axis)) {
+                    stack[stackSize++] = index + 1;
+                    index = node.offset;
+                }
+                else {
+                    stack[stackSize++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stackSize == 0) { break; }
+        index = stack[--stackSize];
+    }
+
+    return nullptr;
+}
+
+/*
+4-wide BVH, collapsed from the binary LinearBVH.
+Each node keeps the boxes of up to four children side by side (struct of arrays, in floats), so a ray can be tested against
+all four in one SIMD pass rather than walking down two levels of the binary tree one box at a time.
+Select it with "acceleration" : { "width" : 4 }; the binary tree is still the default.
+*/
+struct alignas(16) BVH4Node {
+    float minimums[3][4]; //[axis][child]; empty child slots have inverted (+inf -> -inf) boxes, so they are never hit
+    float maximums[3][4];
+    int32_t offset[4];     //interior child: index of its node | leaf child: index of its first primitive
+    uint16_t primCount[4]; //0 for interior children
+    int32_t padding[2];
+
+    BVH4Node () : offset{-1, -1, -1, -1}, primCount{0, 0, 0, 0}, padding{0, 0} {
+        for (int a = 0; a < 3; a++) {
+            for (int c = 0; c < 4; c++) {
+                minimums[a][c] = INFINITY;
+                maximums[a][c] = -INFINITY;
+            }
+        }
+    }
+};
+static_assert(sizeof(BVH4Node) == 128, "BVH4Node should be 128 bytes");
+
+// The ray's data in floats, for the BVH4 box tests; taken from what the Ray already worked out, before the traversal starts
+struct BVH4Ray {
+    float origin[3];
+    float invDirection[3];
+    bool dirIsNeg[3];
+    float tMin;
+
+    BVH4Ray (const Ray& ray) : tMin((float) ray.getTMin()) {
+        vector3 o = ray.getOrigin();
+        for (int a = 0; a < 3; a++) {
+            origin[a] = (float) o.atr[a];
+            invDirection[a] = (float) ray.getInvDirection().atr[a];
+            dirIsNeg[a] = ray.getSign(a);
+        }
+    }
+};
+
+/*
+Slab test of a ray against all four child boxes of a node.
+Returns a bitmask of the children hit between the ray's tMin and maxT (its current tMax), and writes the entry distance of
+each child to tNear.
+Like the binary test, NaN slab distances (a ray lying exactly in a slab plane) are ignored rather than counted as misses.
+*/
+int intersectBVH4Children (const BVH4Node& node, const BVH4Ray& ray, float maxT, float tNear[4]) {
+#if defined(BVH4_SSE)
+    __m128 tEntry = _mm_set1_ps(ray.tMin);
+    __m128 tExit = _mm_set1_ps(maxT);
+    for (int a = 0; a < 3; a++) {
+        const float* nearPlanes = ray.dirIsNeg[a] ? node.maximums[a] : node.minimums[a];
+        const float* farPlanes = ray.dirIsNeg[a] ? node.minimums[a] : node.maximums[a];
+        __m128 origin = _mm_set1_ps(ray.origin[a]);
+        __m128 invD = _mm_set1_ps(ray.invDirection[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearPlanes), origin), invD);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farPlanes), origin), invD);
+        tEntry = _mm_max_ps(t0, tEntry); //max/min hand back the second operand when the first is NaN
+        tExit = _mm_min_ps(t1, tExit);
+    }
+    _mm_storeu_ps(tNear, tEntry);
+    return _mm_movemask_ps(_mm_cmple_ps(tEntry, tExit));
+#else
+    //no SSE (e.g. the M1); plain loops over the four lanes, which the compiler is free to vectorise
+    float tExit[4];
+    for (int c = 0; c < 4; c++) {
+        tNear[c] = ray.tMin;
+        tExit[c] = maxT;
+    }
+    for (int a = 0; a < 3; a++) {
+        const float* nearPlanes = ray.dirIsNeg[a] ? node.maximums[a] : node.minimums[a];
+        const float* farPlanes = ray.dirIsNeg[a] ? node.minimums[a] : node.maximums[a];
+        for (int c = 0; c < 4; c++) {
+            float t0 = (nearPlanes[c] - ray.origin[a]) * ray.invDirection[a];
+            float t1 = (farPlanes[c] - ray.origin[a]) * ray.invDirection[a];
+            if (t0 > tNear[c]) { tNear[c] = t0; }
+            if (t1 < tExit[c]) { tExit[c] = t1; }
+        }
+    }
+    int mask = 0;
+    for (int c = 0; c < 4; c++) {
+        if (tNear[c] <= tExit[c]) { mask |= 1 << c; }
+    }
+    return mask;
+#endif
+}
+
+class LinearBVH4 {
+    public:
+        std::vector<BVH4Node> nodes;
+        std::vector<Shape*> prims; //same leaf order as the binary tree it was collapsed from
+        int maxDepth;
+
+        LinearBVH4 () : maxDepth(0) {}
+        LinearBVH4 (const LinearBVH& binary) : prims(binary.prims), maxDepth(0) {
+            if (binary.nodes.empty()) { return; }
+            nodes.push_back(BVH4Node());
+            collapse(binary, 0, 0, 0);
+        }
+
+    private:
+        static float area (const LinearBVHNode& n) {
+            float x = n.maximums[0] - n.minimums[0];
+            float y = n.maximums[1] - n.minimums[1];
+            float z = n.maximums[2] - n.minimums[2];
+            return 2 * (x * y + y * z + z * x);
+        }
+
+        //pulls the children of binary node binaryIndex up into nodes[index]; while there is room, the biggest interior child
+        //is replaced with its own two children, since that's the box most rays would have to open anyway
+        void collapse (const LinearBVH& binary, int binaryIndex, int index, int depth) {
+            maxDepth = std::max(maxDepth, depth);
+            const LinearBVHNode& root = binary.nodes[binaryIndex];
+
+            int children[4];
+            int count = 0;
+            if (root.primCount > 0) { children[count++] = binaryIndex; } //the whole tree is one leaf
+            else {
+                children[count++] = binaryIndex + 1;
+                children[count++] = root.offset;
+            }
+
+            while (count < 4) {
+                int best = -1;
+                float bestArea = -1;
+                for (int i = 0; i < count; i++) {
+                    const LinearBVHNode& child = binary.nodes[children[i]];
+                    if (child.primCount == 0 && area(child) > bestArea) {
+                        best = i;
+                        bestArea = area(child);
+                    }
+                }
+                if (best == -1) { break; } //only leaves left
+
+                const LinearBVHNode& expand = binary.nodes[children[best]];
+                children[count++] = expand.offset;
+                children[best] = children[best] + 1;
+            }
+
+            BVH4Node node;
+            for (int i = 0; i < count; i++) {
+                const LinearBVHNode& child = binary.nodes[children[i]];
+                for (int a = 0; a < 3; a++) {
+                    node.minimums[a][i] = child.minimums[a];
+                    node.maximums[a][i] = child.maximums[a];
+                }
+                if (child.primCount > 0) {
+                    node.offset[i] = child.offset;
+                    node.primCount[i] = child.primCount;
+                }
+                else {
+                    node.offset[i] = nodes.size();
+                    nodes.push_back(BVH4Node());
+                }
+            }
+            nodes[index] = node;
+
+            for (int i = 0; i < count; i++) {
+                if (node.primCount[i] == 0) { collapse(binary, children[i], node.offset[i], depth + 1); }
+            }
+        }
+};
+
+// Pending child on the BVH4 traversal stack; leaves are pushed as well, so they get tested in distance order too
+struct BVH4StackEntry {
+    int32_t offset;
+    int32_t primCount;
+    float tNear;
+};
+
+/*
+Closest hit through the 4-wide BVH; same rules as the binary intersectBVH.
+The children a ray hits are pushed furthest first, so the nearest is popped next, and anything entered beyond the
+closest hit found so far is dropped when it comes off the stack.
+*/
+Hit intersectBVH(Ray& ray, const std::list<LightSource*>& l, const vector3& look, const LinearBVH4* bvh, bool calcMaterial = true) {
+    if (!bvh || bvh->nodes.empty()) {
         Hit h = Hit();
         h.setChecks(1);
         return h;
     }
 
-    //std::cout << node->bounds.intersect(ray, l, look, calcMaterial).getT() << std::endl;
-    //calculate sub-trees
-    Hit hitLeft = intersectBVH(camPos, ray, l, look, node->left, calcMaterial);
-    Hit hitRight = intersectBVH(camPos, ray, l, look, node->right, calcMaterial);
-    
-    //for debugginf -> set each subnode to have the same (total) checks
-    int total = hitRight.getChecks() + hitLeft.getChecks();
-    hitLeft.setChecks(total);
-    hitRight.setChecks(total);
-    //std::cout << hitLeft.getChecks() << std::endl;
+    guardSecondaryRay(ray, calcMaterial);
+    BVH4Ray wideRay = BVH4Ray(ray);
+    BVH4StackEntry stackBuffer[BVH_STACK_SIZE];
+    std::vector<BVH4StackEntry> bigStack;
+    BVH4StackEntry* stack = stackBuffer;
+    if (3 * bvh->maxDepth + 4 > BVH_STACK_SIZE) { //every level nets at most 3 more entries
+        bigStack.resize(3 * bvh->maxDepth + 4);
+        stack = bigStack.data();
+    }
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0};
+
+    Shape* closestShape = nullptr;
+    int checks = 0;
+
+    while (stackSize > 0) {
+        BVH4StackEntry entry = stack[--stackSize];
+        if (entry.tNear > ray.getTMax()) { continue; }
+
+        if (entry.primCount > 0) {
+            for (int i = entry.offset; i < entry.offset + entry.primCount; i++) {
+                double t = bvh->prims[i]->hitDistance(ray);
+                if (t >= 0 && (!closestShape || t < ray.getTMax())) {
+                    ray.setTMax(t);
+                    closestShape = bvh->prims[i];
+                }
+            }
+            continue;
+        }
+
+        const BVH4Node& node = bvh->nodes[entry.offset];
+        checks++;
+        float tNear[4];
+        int mask = intersectBVH4Children(node, wideRay, (float) ray.getTMax(), tNear);
+
+        //insertion sort the hit children, furthest first
+        int order[4];
+        int hits = 0;
+        for (int c = 0; c < 4; c++) {
+            if (!(mask & (1 << c))) { continue; }
+            int j = hits++;
+            while (j > 0 && tNear[order[j - 1]] < tNear[c]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = c;
+        }
+        for (int i = 0; i < hits; i++) {
+            int c = order[i];
+            stack[stackSize++] = {node.offset[c], node.primCount[c], tNear[c]};
+        }
+    }
+
+    if (!closestShape) {
+        Hit h = Hit();
+        h.setChecks(checks);
+        return h;
+    }
+
+    Hit h = closestShape->intersect(ray, l, look, calcMaterial);
+    h.setChecks(checks);
+    return h;
+}
+
+// Any-hit shadow query through the 4-wide BVH; same rules as the binary findOccluder, and no sorting since any blocker will do
+Shape* findOccluder (const LinearBVH4* bvh, Ray& ray, int ignoreID, int ignoreInstanceID = -1) {
+    if (!bvh || bvh->nodes.empty()) { return nullptr; }
+
+    BVH4Ray wideRay = BVH4Ray(ray);
+    int stackBuffer[BVH_STACK_SIZE];
+    std::vector<int> bigStack;
+    int* stack = stackBuffer;
+    if (3 * bvh->maxDepth + 4 > BVH_STACK_SIZE) {
+        bigStack.resize(3 * bvh->maxDepth + 4);
+        stack = bigStack.data();
+    }
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const BVH4Node& node = bvh->nodes[stack[--stackSize]];
+        float tNear[4];
+        int mask = intersectBVH4Children(node, wideRay, (float) ray.getTMax(), tNear);
+
+        for (int c = 0; c < 4; c++) {
+            if (!(mask & (1 << c))) { continue; }
+            if (node.primCount[c] == 0) {
+                stack[stackSize++] = node.offset[c];
+                continue;
+            }
+            for (int i = node.offset[c]; i < node.offset[c] + node.primCount[c]; i++) {
+                Shape* s = bvh->prims[i];
+                if (s->occludes(ray, ignoreID, ignoreInstanceID)) { return s; }
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+/*
+Surface area heuristic (SAH) builder.
+Rather than always splitting at the index midpoint, primitive centroids are dropped into a handful of bins along each axis,
+and the split that minimises the expected cost of a ray visiting both children is chosen.
+This keeps tight clusters (e.g. lots of small spheres next to a giant ground triangle) out of each other's boxes.
+*/
+const int SAH_BIN_COUNT = 12;
+const double SAH_TRAVERSAL_COST = 1.0;   //relative cost of a box test
+const double SAH_INTERSECTION_COST = 2.0; //relative cost of a primitive test; virtual call + a fair bit more maths
+
+// Per-shape build information; caching the bounds saves a lot of virtual calls during builds
+struct BVHPrimitive {
+    Shape* shape;
+    int index; //position of the shape in the scene's shape list
+    vector3 minimums;
+    vector3 maximums;
+    vector3 centroid;
+
+    BVHPrimitive (Shape* s, int i) : shape(s), index(i), minimums(s->getMinimums()), maximums(s->getMaximums()) {
+        centroid = (minimums + maximums) * 0.5;
+    }
+    //a reference to only part of the shape (see the spatial split builder), so only part of its box
+    BVHPrimitive (Shape* s, int i, vector3 mi, vector3 ma) : shape(s), index(i), minimums(mi), maximums(ma) {
+        centroid = (minimums + maximums) * 0.5;
+    }
+};
+
+std::vector<BVHPrimitive> makeBVHPrimitives (const std::vector<Shape*>& shapes) {
+    std::vector<BVHPrimitive> prims;
+    prims.reserve(shapes.size());
+    for (int i = 0; i < (int) shapes.size(); i++) { prims.push_back(BVHPrimitive(shapes[i], i)); }
+    return prims;
+}
+
+//surface area of the box spanning mi -> ma; empty boxes (mi > ma) have no area
+double boxSurfaceArea (const vector3& mi, const vector3& ma) {
+    vector3 d = ma - mi;
+    if (d.x() < 0 || d.y() < 0 || d.z() < 0) { return 0; }
+    return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+/*
+Parallel building: the two halves of a split never touch the same part of the primitive list, so near the top of the tree
+the left subtree is handed to a new thread while the current one carries on with the right.
+Each level of threadDepth doubles the number of threads; below that (or for small subtrees) the build carries on serially.
+*/
+const int BVH_PARALLEL_MIN_PRIMS = 4096; //smaller subtrees are quicker to build than a thread is to start
+
+// Timings gathered across every thread that helped with a build, for reporting utilisation
+struct BVHBuildStats {
+    std::atomic<int> threadsUsed{1};
+    std::atomic<long long> threadNanoseconds{0}; //lifetime of every worker thread
+    std::atomic<long long> waitNanoseconds{0};   //time threads spent blocked waiting for a worker to finish
+};
+
+long long nanosecondsSince (std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//threadDepth levels are enough threads to cover every hardware thread at least once
+int bvhThreadDepth () {
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    int depth = 0;
+    while ((1 << depth) < threads) { depth++; }
+    return depth;
+}
+
+//runs body(begin, end) over count items split into even chunks, one per hardware thread; small jobs just run on this thread
+template <typename Body>
+void parallelFor (int count, Body body) {
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, count / BVH_PARALLEL_MIN_PRIMS);
+    if (threads <= 1) {
+        body(0, count);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back(body, (int) ((long long) count * t / threads), (int) ((long long) count * (t + 1) / threads));
+    }
+    for (auto& worker : workers) { worker.join(); }
+}
+
+//fills in both children of node; buildLeft & buildRight take the threadDepth left for their subtree
+template <typename BuildLeft, typename BuildRight>
+void buildBVHChildren (BVHNode* node, int count, int threadDepth, BVHBuildStats* stats, BuildLeft buildLeft, BuildRight buildRight) {
+    if (threadDepth <= 0 || count < BVH_PARALLEL_MIN_PRIMS) {
+        node->left = buildLeft(0);
+        node->right = buildRight(0);
+        return;
+    }
+
+    if (stats) { stats->threadsUsed++; }
+    std::thread worker([&]() {
+        auto start = std::chrono::steady_clock::now();
+        node->left = buildLeft(threadDepth - 1);
+        if (stats) { stats->threadNanoseconds += nanosecondsSince(start); }
+    });
+    node->right = buildRight(threadDepth - 1);
+
+    auto waitStart = std::chrono::steady_clock::now();
+    worker.join();
+    if (stats) { stats->waitNanoseconds += nanosecondsSince(waitStart); }
+}
+
+// The cheapest centroid-binned object split of prims[start..end]; axis is -1 when every centroid coincides.
+// cost is relative to the node's area (sum of child area * primitive count), and the child bounds are kept so the
+// spatial split builder can see how much the two halves overlap
+struct SAHSplit {
+    int axis = -1;
+    int bin = 0;
+    double cost = INFINITY;
+    vector3 leftMin, leftMax, rightMin, rightMax;
+};
+
+inline int sahBin (const BVHPrimitive& p, int axis, double axisMin, double extent) {
+    return std::min(SAH_BIN_COUNT - 1, (int) (SAH_BIN_COUNT * ((p.centroid.atr[axis] - axisMin) / extent)));
+}
+
+SAHSplit findSAHSplit (const std::vector<BVHPrimitive>& prims, int start, int end, vector3 centMin, vector3 centMax) {
+    SAHSplit best;
+    for (int axis = 0; axis < 3; axis++) {
+        double extent = centMax.atr[axis] - centMin.atr[axis];
+        if (extent <= 0) { continue; } //every centroid is in the same plane; nothing to split here
+
+        int counts[SAH_BIN_COUNT] = {0};
+        vector3 binMin[SAH_BIN_COUNT];
+        vector3 binMax[SAH_BIN_COUNT];
+        for (int b = 0; b < SAH_BIN_COUNT; b++) {
+            binMin[b] = {INFINITY, INFINITY, INFINITY};
+            binMax[b] = {-INFINITY, -INFINITY, -INFINITY};
+        }
+        for (int i = start; i <= end; i++) {
+            int b = sahBin(prims[i], axis, centMin.atr[axis], extent);
+            counts[b]++;
+            binMin[b] = vectMin(binMin[b], prims[i].minimums);
+            binMax[b] = vectMax(binMax[b], prims[i].maximums);
+        }
+
+        //sweep from the right to get the bounds & count of everything right of each boundary, then sweep back from the left
+        vector3 rightMin[SAH_BIN_COUNT];
+        vector3 rightMax[SAH_BIN_COUNT];
+        int rightCount[SAH_BIN_COUNT];
+        vector3 accMin = {INFINITY, INFINITY, INFINITY};
+        vector3 accMax = {-INFINITY, -INFINITY, -INFINITY};
+        int accCount = 0;
+        for (int b = SAH_BIN_COUNT - 1; b > 0; b--) {
+            accMin = vectMin(accMin, binMin[b]);
+            accMax = vectMax(accMax, binMax[b]);
+            accCount += counts[b];
+            rightMin[b] = accMin;
+            rightMax[b] = accMax;
+            rightCount[b] = accCount;
+        }
+
+        accMin = {INFINITY, INFINITY, INFINITY};
+        accMax = {-INFINITY, -INFINITY, -INFINITY};
+        accCount = 0;
+        for (int b = 0; b < SAH_BIN_COUNT - 1; b++) {
+            accMin = vectMin(accMin, binMin[b]);
+            accMax = vectMax(accMax, binMax[b]);
+            accCount += counts[b];
+            if (accCount == 0 || rightCount[b + 1] == 0) { continue; }
+            double cost = accCount * boxSurfaceArea(accMin, accMax) + rightCount[b + 1] * boxSurfaceArea(rightMin[b + 1], rightMax[b + 1]);
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.leftMin = accMin;
+                best.leftMax = accMax;
+                best.rightMin = rightMin[b + 1];
+                best.rightMax = rightMax[b + 1];
+            }
+        }
+    }
+    return best;
+}
+
+// Function to build a BVH using binned SAH splits; reorders prims[start..end] as it goes, and leaves reference ranges of prims.
+// A node becomes a leaf once it holds no more than maxLeafSize shapes and the SAH reckons testing them all beats splitting.
+BVHNode* buildSAHBVH(std::vector<BVHPrimitive>& prims, int start, int end, int maxLeafSize = BVH_MAX_LEAF_SIZE,
+                     int threadDepth = 0, BVHBuildStats* stats = nullptr) {
+    if (start == end) {
+        return makeBVHLeaf(Cube(prims[start].minimums, prims[start].maximums), start, 1);
+    }
+
+    // Calculate the bounds of the node, and the bounds of the primitive centroids (which is what we bin over)
+    vector3 nodeMin = {INFINITY, INFINITY, INFINITY};
+    vector3 nodeMax = {-INFINITY, -INFINITY, -INFINITY};
+    vector3 centMin = nodeMin;
+    vector3 centMax = nodeMax;
+    for (int i = start; i <= end; i++) {
+        nodeMin = vectMin(nodeMin, prims[i].minimums);
+        nodeMax = vectMax(nodeMax, prims[i].maximums);
+        centMin = vectMin(centMin, prims[i].centroid);
+        centMax = vectMax(centMax, prims[i].centroid);
+    }
+    Cube nodeBounds = Cube(nodeMin, nodeMax);
 
-    //reshape the node if either hit point was on the boundary of this bounding box
-    //this is only necessary for getting shadows to appear on triangles -> was not a fun debugging process
-    node->bounds.reshapeIfOnBoundary(hitLeft.getPoint());
-    node->bounds.reshapeIfOnBoundary(hitRight.getPoint());
+    // Find the cheapest bin boundary over all three axes
+    SAHSplit split = findSAHSplit(prims, start, end, centMin, centMax);
+    int bestAxis = split.axis;
+    int bestSplit = split.bin;
+    double bestCost = split.cost;
+
+    //bestCost is relative to the node's area, so scale it down to compare against just testing everything in here
+    int count = end - start + 1;
+    if (count <= maxLeafSize) {
+        double nodeArea = boxSurfaceArea(nodeMin, nodeMax);
+        double leafCost = SAH_INTERSECTION_COST * count;
+        double splitCost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * (nodeArea > 0 ? bestCost / nodeArea : count);
+        if (bestAxis == -1 || leafCost <= splitCost) {
+            return makeBVHLeaf(nodeBounds, start, count);
+        }
+    }
 
-    if ((hitRight.getT() < hitLeft.getT() && hitRight.getT() >= 0) || (hitLeft.getT() < 0)) { return hitRight;}
-    return hitLeft;
+    int mid = (start + end) / 2;
+    int splitAxis = bestAxis;
+    if (bestAxis != -1) {
+        double extent = centMax.atr[bestAxis] - centMin.atr[bestAxis];
+        double axisMin = centMin.atr[bestAxis];
+        auto pivot = std::partition(prims.begin() + start, prims.begin() + end + 1, [=](const BVHPrimitive& p) {
+            return sahBin(p, bestAxis, axisMin, extent) <= bestSplit;
+        });
+        mid = (pivot - prims.begin()) - 1;
+    }
+    else {
+        //all the centroids coincide, so any split is as good as another -> fall back to halving the list
+        splitAxis = nodeBounds.longestAxis();
+        std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end + 1, [splitAxis](const BVHPrimitive& a, const BVHPrimitive& b) {
+            return a.centroid.atr[splitAxis] < b.centroid.atr[splitAxis];
+        });
+    }
+
+    BVHNode* node = new BVHNode(nodeBounds);
+    node->axis = splitAxis;
+    buildBVHChildren(node, end - start + 1, threadDepth, stats,
+        [&](int depth) { return buildSAHBVH(prims, start, mid, maxLeafSize, depth, stats); },
+        [&](int depth) { return buildSAHBVH(prims, mid + 1, end, maxLeafSize, depth, stats); });
+    return node;
 }
 
-// Function to build a BVH from a list of spheres
-BVHNode* buildBVH(vector3 camPos, std::vector<Shape*>& shapes, int start, int end) {
+// Function to build a BVH from a list of spheres; reorders the primitive index array indices[start..end] rather than the shapes
+BVHNode* buildBVH(const std::vector<Shape*>& shapes, std::vector<int>& indices, int start, int end, int maxLeafSize = BVH_MAX_LEAF_SIZE,
+                  int threadDepth = 0, BVHBuildStats* stats = nullptr) {
     if (start == end) {
-        BVHNode* leafNode = new BVHNode(Cube(shapes[start], camPos));
-        leafNode->shape = shapes[start];
-        return leafNode;
+        return makeBVHLeaf(Cube(shapes[indices[start]]->getMinimums(), shapes[indices[start]]->getMaximums()), start, 1);
     }
     //std::cout << end - start << std::endl;
 
-    // Calculate bounding box for the current node
-    std::vector<Shape*> partialShapeList = {};
+    // Calculate bounding box for the current node; straight from the shapes, rather than copying them into a new list each level
+    vector3 nodeMin = {INFINITY, INFINITY, INFINITY};
+    vector3 nodeMax = {-INFINITY, -INFINITY, -INFINITY};
     for (int i = start; i <= end; i++) {
-        partialShapeList.push_back(shapes[i]);
+        nodeMin = vectMin(nodeMin, shapes[indices[i]]->getMinimums());
+        nodeMax = vectMax(nodeMax, shapes[indices[i]]->getMaximums());
+    }
+    Cube nodeBounds = Cube(nodeMin, nodeMax);
+
+    // Small enough to just test everything in the box
+    if (end - start + 1 <= maxLeafSize) {
+        return makeBVHLeaf(nodeBounds, start, end - start + 1);
     }
-    Cube nodeBounds = Cube(partialShapeList, camPos);
-    //partialShapeList = {};
 
     // Sort the spheres along the longest axis
     int splitAxis = nodeBounds.longestAxis();
     int mid = (start + end) / 2;
-    std::nth_element(shapes.begin() + start, shapes.begin() + mid, shapes.begin() + end + 1, [splitAxis]( Shape* a, Shape* b) {
-        return a->getCenter().atr[splitAxis] < b->getCenter().atr[splitAxis];
+    std::nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end + 1, [&shapes, splitAxis](int a, int b) {
+        return shapes[a]->getCenter().atr[splitAxis] < shapes[b]->getCenter().atr[splitAxis];
     });
 
     // Create the current BVH node
     BVHNode* node = new BVHNode(nodeBounds);
-    node->left = buildBVH(camPos, shapes, start, mid);
-    node->right = buildBVH(camPos, shapes, mid + 1, end);
+    node->axis = splitAxis;
+    buildBVHChildren(node, end - start + 1, threadDepth, stats,
+        [&](int depth) { return buildBVH(shapes, indices, start, mid, maxLeafSize, depth, stats); },
+        [&](int depth) { return buildBVH(shapes, indices, mid + 1, end, maxLeafSize, depth, stats); });
     //TODO: cull nodes if they contain a shape of 'null' type -> might require a travsersal 'trim' function?
 
     return node;
 }
 
-// Prints the acceleration structure before rendering in a very neat and nice fashion!
-bool printBVH(BVHNode* root, std::string lvl) {
-    
-    std::cout << lvl << "Node - " ;
-    if (root -> shape) {
-        std::cout << "contains: [" << root -> shape -> getType() << "]" << std::endl;
-        std::cout << lvl << "Size -> " << root->bounds.x() << " : " << root->bounds.y()<<  " : "  << root->bounds.z() << std::endl;
-        vector3 c = root-> bounds.getCenter();
-        std::cout << lvl << "Center -> " << c.x() << " : " << c.y()<<  " : "  << c.z() << std::endl;
-        return false;
-    }
-    else { std::cout << "nonleaf"; }
-    std::cout << std::endl;
-    std::string nextLvl = "    " + lvl;
-
-    std::cout << lvl << "Size -> " << root->bounds.x() << " : " << root->bounds.y()<<  " : "  << root->bounds.z() << std::endl;
-    vector3 c = root-> bounds.getCenter();
-    std::cout << lvl << "Center -> " << c.x() << " : " << c.y()<<  " : "  << c.z() << std::endl;
-
-    std::cout << lvl << "L: " << std::endl;
-    printBVH(root->left, nextLvl);
-    std::cout << lvl << "R: " << std::endl;
-    printBVH(root->right, nextLvl);
+/*
+Spatial split BVH (SBVH) builder, after Stich et al., "Spatial Splits in Bounding Volume Hierarchies".
+Long thin shapes (slivers of a tessellated mesh, diagonal cylinders) have huge boxes that overlap everything nearby, and
+no way of sorting whole shapes into two groups pulls those boxes apart. So alongside the usual object splits, this builder
+also tries cutting the node in space: shapes straddling the plane go into both children, each copy bounded by just its
+clipped part. Every cut adds references to the tree, so splitBudget caps how many extra references (as a fraction of the
+shape count) the whole build may add; once it's spent, the builder carries on with plain SAH object splits.
+Leaves can therefore share shapes, and the primitive index array it hands back can be longer than the shape list.
+*/
+const int SBVH_BIN_COUNT = 16;
+const double SBVH_SPLIT_BUDGET = 0.3;  //default budget: up to 30% more references than shapes
+const double SBVH_MIN_OVERLAP = 1e-5;  //only look for a spatial split when the object split's children overlap by more than this much of the root's area
+const int SBVH_MAX_SPLIT_DEPTH = 48;   //no spatial splits below this depth; keeps the trees within a sensible traversal stack
+
+struct SBVHBuildState {
+    int maxLeafSize;
+    double rootArea;
+    int referenceLimit;
+    std::atomic<int> references;
+    std::mutex leafLock;
+    std::vector<BVHPrimitive> leafRefs; //every leaf's references, in the order the leaves were made
+
+    SBVHBuildState (int leafSize, double area, int shapeCount, double splitBudget)
+        : maxLeafSize(leafSize), rootArea(area), references(shapeCount) {
+        referenceLimit = shapeCount + (int) (shapeCount * std::max(0.0, splitBudget));
+    }
+};
+
+// The part of ref lying between lo & hi along axis; false if none of it does
+bool clipReference (const BVHPrimitive& ref, int axis, double lo, double hi, BVHPrimitive& clipped) {
+    vector3 mi, ma;
+    if (!ref.shape->clipBounds(axis, lo, hi, mi, ma)) { return false; }
+    //the reference may already have been cut down on other axes, so don't let it grow back past its current box
+    mi = vectMax(mi, ref.minimums);
+    ma = vectMin(ma, ref.maximums);
+    for (int a = 0; a < 3; a++) {
+        if (mi.atr[a] > ma.atr[a]) { return false; }
+    }
+    clipped = BVHPrimitive(ref.shape, ref.index, mi, ma);
     return true;
 }
 
+// The cheapest spatial split of a node; cost is relative to the node's area as with SAHSplit
+struct SpatialSplit {
+    int axis = -1;
+    double plane = 0;
+    double cost = INFINITY;
+    int straddling = 0; //references that would end up in both children (before any are unsplit)
+};
+
+SpatialSplit findSpatialSplit (const std::vector<BVHPrimitive>& refs, vector3 nodeMin, vector3 nodeMax) {
+    SpatialSplit best;
+    int count = refs.size();
+    for (int axis = 0; axis < 3; axis++) {
+        double axisMin = nodeMin.atr[axis];
+        double binWidth = (nodeMax.atr[axis] - axisMin) / SBVH_BIN_COUNT;
+        if (binWidth <= 0) { continue; }
+        auto binOf = [=](double x) { return std::clamp((int) ((x - axisMin) / binWidth), 0, SBVH_BIN_COUNT - 1); };
+
+        //every reference enters the bin holding its minimum and exits the one holding its maximum,
+        //and adds its clipped box to each bin it passes through
+        int entries[SBVH_BIN_COUNT] = {0};
+        int exits[SBVH_BIN_COUNT] = {0};
+        vector3 binMin[SBVH_BIN_COUNT];
+        vector3 binMax[SBVH_BIN_COUNT];
+        for (int b = 0; b < SBVH_BIN_COUNT; b++) {
+            binMin[b] = {INFINITY, INFINITY, INFINITY};
+            binMax[b] = {-INFINITY, -INFINITY, -INFINITY};
+        }
+        for (const BVHPrimitive& ref : refs) {
+            int first = binOf(ref.minimums.atr[axis]);
+            int last = std::max(first, binOf(ref.maximums.atr[axis]));
+            entries[first]++;
+            exits[last]++;
+            if (first == last) {
+                binMin[first] = vectMin(binMin[first], ref.minimums);
+                binMax[first] = vectMax(binMax[first], ref.maximums);
+                continue;
+            }
+            for (int b = first; b <= last; b++) {
+                BVHPrimitive piece = ref;
+                double lo = axisMin + b * binWidth;
+                double hi = (b == SBVH_BIN_COUNT - 1) ? nodeMax.atr[axis] : lo + binWidth;
+                if (!clipReference(ref, axis, lo, hi, piece)) { continue; }
+                binMin[b] = vectMin(binMin[b], piece.minimums);
+                binMax[b] = vectMax(binMax[b], piece.maximums);
+            }
+        }
+
+        double rightArea[SBVH_BIN_COUNT];
+        int rightCount[SBVH_BIN_COUNT];
+        vector3 accMin = {INFINITY, INFINITY, INFINITY};
+        vector3 accMax = {-INFINITY, -INFINITY, -INFINITY};
+        int accCount = 0;
+        for (int b = SBVH_BIN_COUNT - 1; b > 0; b--) {
+            accMin = vectMin(accMin, binMin[b]);
+            accMax = vectMax(accMax, binMax[b]);
+            accCount += exits[b];
+            rightArea[b] = boxSurfaceArea(accMin, accMax);
+            rightCount[b] = accCount;
+        }
+
+        accMin = {INFINITY, INFINITY, INFINITY};
+        accMax = {-INFINITY, -INFINITY, -INFINITY};
+        accCount = 0;
+        for (int b = 0; b < SBVH_BIN_COUNT - 1; b++) {
+            accMin = vectMin(accMin, binMin[b]);
+            accMax = vectMax(accMax, binMax[b]);
+            accCount += entries[b];
+            int right = rightCount[b + 1];
+            if (accCount == 0 || right == 0) { continue; }
+            if (accCount == count && right == count) { continue; } //everything straddles; the children would be no smaller
+            double cost = accCount * boxSurfaceArea(accMin, accMax) + right * rightArea[b + 1];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = axisMin + (b + 1) * binWidth;
+                best.straddling = accCount + right - count;
+            }
+        }
+    }
+    return best;
+}
+
+// Sort refs either side of a spatial split. Straddling references are cut in two, unless putting the whole thing on
+// one side turns out cheaper ("reference unsplitting") - which is often the case for shapes that only just cross the plane
+void splitReferences (const std::vector<BVHPrimitive>& refs, const SpatialSplit& split,
+                      std::vector<BVHPrimitive>& left, std::vector<BVHPrimitive>& right) {
+    int axis = split.axis;
+    vector3 leftMin = {INFINITY, INFINITY, INFINITY};
+    vector3 leftMax = {-INFINITY, -INFINITY, -INFINITY};
+    vector3 rightMin = leftMin;
+    vector3 rightMax = leftMax;
+    auto addLeft = [&](const BVHPrimitive& p) { left.push_back(p); leftMin = vectMin(leftMin, p.minimums); leftMax = vectMax(leftMax, p.maximums); };
+    auto addRight = [&](const BVHPrimitive& p) { right.push_back(p); rightMin = vectMin(rightMin, p.minimums); rightMax = vectMax(rightMax, p.maximums); };
+
+    std::vector<int> straddling;
+    for (int i = 0; i < (int) refs.size(); i++) {
+        if (refs[i].maximums.atr[axis] <= split.plane) { addLeft(refs[i]); }
+        else if (refs[i].minimums.atr[axis] >= split.plane) { addRight(refs[i]); }
+        else { straddling.push_back(i); }
+    }
+
+    for (int i : straddling) {
+        const BVHPrimitive& ref = refs[i];
+        BVHPrimitive leftPart = ref;
+        BVHPrimitive rightPart = ref;
+        bool hasLeft = clipReference(ref, axis, -INFINITY, split.plane, leftPart);
+        bool hasRight = clipReference(ref, axis, split.plane, INFINITY, rightPart);
+        if (!hasRight) { addLeft(hasLeft ? leftPart : ref); continue; } //only grazes the plane
+        if (!hasLeft) { addRight(rightPart); continue; }
+
+        double nl = left.size();
+        double nr = right.size();
+        double splitCost = (nl + 1) * boxSurfaceArea(vectMin(leftMin, leftPart.minimums), vectMax(leftMax, leftPart.maximums))
+                         + (nr + 1) * boxSurfaceArea(vectMin(rightMin, rightPart.minimums), vectMax(rightMax, rightPart.maximums));
+        double leftCost = (nl + 1) * boxSurfaceArea(vectMin(leftMin, ref.minimums), vectMax(leftMax, ref.maximums))
+                        + nr * boxSurfaceArea(rightMin, rightMax);
+        double rightCost = nl * boxSurfaceArea(leftMin, leftMax)
+                         + (nr + 1) * boxSurfaceArea(vectMin(rightMin, ref.minimums), vectMax(rightMax, ref.maximums));
+
+        if (splitCost < leftCost && splitCost < rightCost) {
+            addLeft(leftPart);
+            addRight(rightPart);
+        }
+        else if (leftCost <= rightCost) { addLeft(ref); }
+        else { addRight(ref); }
+    }
+}
+
+BVHNode* buildSBVH (SBVHBuildState& state, std::vector<BVHPrimitive>& refs, int depth = 0, int threadDepth = 0, BVHBuildStats* stats = nullptr) {
+    int count = refs.size();
+    vector3 nodeMin = {INFINITY, INFINITY, INFINITY};
+    vector3 nodeMax = {-INFINITY, -INFINITY, -INFINITY};
+    vector3 centMin = nodeMin;
+    vector3 centMax = nodeMax;
+    for (const BVHPrimitive& ref : refs) {
+        nodeMin = vectMin(nodeMin, ref.minimums);
+        nodeMax = vectMax(nodeMax, ref.maximums);
+        centMin = vectMin(centMin, ref.centroid);
+        centMax = vectMax(centMax, ref.centroid);
+    }
+    Cube nodeBounds = Cube(nodeMin, nodeMax);
+
+    auto makeLeaf = [&]() {
+        std::lock_guard<std::mutex> lock(state.leafLock);
+        int first = state.leafRefs.size();
+        state.leafRefs.insert(state.leafRefs.end(), refs.begin(), refs.end());
+        return makeBVHLeaf(nodeBounds, first, count);
+    };
+    if (count == 1) { return makeLeaf(); }
+
+    //only bother looking for a spatial split where the best object split leaves the children overlapping
+    SAHSplit objectSplit = findSAHSplit(refs, 0, count - 1, centMin, centMax);
+    SpatialSplit spatialSplit;
+    if (depth < SBVH_MAX_SPLIT_DEPTH && state.references < state.referenceLimit) {
+        double overlap = INFINITY;
+        if (objectSplit.axis != -1) {
+            overlap = boxSurfaceArea(vectMax(objectSplit.leftMin, objectSplit.rightMin), vectMin(objectSplit.leftMax, objectSplit.rightMax));
+        }
+        if (overlap > SBVH_MIN_OVERLAP * state.rootArea) { spatialSplit = findSpatialSplit(refs, nodeMin, nodeMax); }
+    }
+
+    //claim the budget for the duplicates up front, so parallel subtrees can't overspend it between them
+    bool spatial = spatialSplit.axis != -1 && spatialSplit.cost < objectSplit.cost;
+    if (spatial && state.references.fetch_add(spatialSplit.straddling) + spatialSplit.straddling > state.referenceLimit) {
+        state.references -= spatialSplit.straddling;
+        spatial = false;
+    }
+
+    if (count <= state.maxLeafSize) {
+        double bestCost = spatial ? spatialSplit.cost : objectSplit.cost;
+        double nodeArea = boxSurfaceArea(nodeMin, nodeMax);
+        double leafCost = SAH_INTERSECTION_COST * count;
+        double splitCost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * (nodeArea > 0 ? bestCost / nodeArea : count);
+        if ((!spatial && objectSplit.axis == -1) || leafCost <= splitCost) {
+            if (spatial) { state.references -= spatialSplit.straddling; }
+            return makeLeaf();
+        }
+    }
+
+    std::vector<BVHPrimitive> left;
+    std::vector<BVHPrimitive> right;
+    int splitAxis = objectSplit.axis;
+    if (spatial) {
+        splitReferences(refs, spatialSplit, left, right);
+        state.references += (int) (left.size() + right.size()) - count - spatialSplit.straddling; //give back whatever got unsplit
+        splitAxis = spatialSplit.axis;
+    }
+    else if (objectSplit.axis != -1) {
+        double extent = centMax.atr[objectSplit.axis] - centMin.atr[objectSplit.axis];
+        for (const BVHPrimitive& ref : refs) {
+            bool goesLeft = sahBin(ref, objectSplit.axis, centMin.atr[objectSplit.axis], extent) <= objectSplit.bin;
+            (goesLeft ? left : right).push_back(ref);
+        }
+    }
+    if (left.empty() || right.empty()) {
+        //all the centroids coincide (or unsplitting piled everything on one side), so fall back to halving the list
+        splitAxis = nodeBounds.longestAxis();
+        int mid = count / 2;
+        std::nth_element(refs.begin(), refs.begin() + mid, refs.end(), [splitAxis](const BVHPrimitive& a, const BVHPrimitive& b) {
+            return a.centroid.atr[splitAxis] < b.centroid.atr[splitAxis];
+        });
+        left.assign(refs.begin(), refs.begin() + mid);
+        right.assign(refs.begin() + mid, refs.end());
+    }
+    //the children have their own copies now; don't hold on to this level's while they build
+    std::vector<BVHPrimitive>().swap(refs);
+
+    BVHNode* node = new BVHNode(nodeBounds);
+    node->axis = splitAxis;
+    buildBVHChildren(node, count, threadDepth, stats,
+        [&](int threads) { return buildSBVH(state, left, depth + 1, threads, stats); },
+        [&](int threads) { return buildSBVH(state, right, depth + 1, threads, stats); });
+    return node;
+}
+
+/*
+Linear BVH (LBVH) builder, for when build speed matters more than tree quality (e.g. rebuilding every frame of an animation).
+Primitive centroids are quantised to a 1024^3 grid and given a 30 bit Morton code, which interleaves the bits of the three
+coordinates so that sorting by code lays the primitives out along a space filling curve. After a radix sort, every split is
+just the point where the highest differing bit of the codes flips, so no bounds are ever binned or compared while building.
+*/
+const int MORTON_BITS_PER_AXIS = 10;
+const int RADIX_BITS_PER_PASS = 8;
+
+struct MortonPrimitive {
+    uint32_t code;
+    int index; //into the BVHPrimitive list
+};
+
+//spreads the lowest 10 bits of v out so there are two zero bits between each of them
+uint32_t spreadMortonBits (uint32_t v) {
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+//bit 3k holds bit k of x, 3k + 1 of y, and 3k + 2 of z
+uint32_t encodeMorton (const vector3& p) {
+    return (spreadMortonBits((uint32_t) p.z()) << 2) | (spreadMortonBits((uint32_t) p.y()) << 1) | spreadMortonBits((uint32_t) p.x());
+}
+
+// Least significant digit radix sort on the Morton codes; every pass counts digits per chunk, then scatters each chunk in parallel
+void radixSortMorton (std::vector<MortonPrimitive>& items) {
+    const int bucketCount = 1 << RADIX_BITS_PER_PASS;
+    const int totalBits = 3 * MORTON_BITS_PER_AXIS;
+    int count = items.size();
+    std::vector<MortonPrimitive> sorted(count);
+
+    int chunks = std::max(1, std::min((int) std::thread::hardware_concurrency(), count / BVH_PARALLEL_MIN_PRIMS));
+    std::vector<int> chunkStart(chunks + 1);
+    for (int c = 0; c <= chunks; c++) { chunkStart[c] = (int) ((long long) count * c / chunks); }
+
+    //runs body(chunk) for every chunk at once
+    auto forEachChunk = [chunks](auto body) {
+        std::vector<std::thread> workers;
+        for (int c = 1; c < chunks; c++) { workers.emplace_back(body, c); }
+        body(0);
+        for (auto& worker : workers) { worker.join(); }
+    };
+
+    for (int shift = 0; shift < totalBits; shift += RADIX_BITS_PER_PASS) {
+        std::vector<std::vector<int>> offsets(chunks, std::vector<int>(bucketCount, 0));
+        forEachChunk([&](int c) {
+            for (int i = chunkStart[c]; i < chunkStart[c + 1]; i++) {
+                offsets[c][(items[i].code >> shift) & (bucketCount - 1)]++;
+            }
+        });
+
+        //bucket b of chunk c starts after every smaller bucket, and after bucket b of every earlier chunk; keeps the sort stable
+        int running = 0;
+        for (int b = 0; b < bucketCount; b++) {
+            for (int c = 0; c < chunks; c++) {
+                int n = offsets[c][b];
+                offsets[c][b] = running;
+                running += n;
+            }
+        }
+
+        forEachChunk([&](int c) {
+            for (int i = chunkStart[c]; i < chunkStart[c + 1]; i++) {
+                sorted[offsets[c][(items[i].code >> shift) & (bucketCount - 1)]++] = items[i];
+            }
+        });
+        items.swap(sorted);
+    }
+}
+
+// Function to build a BVH over Morton sorted primitives; splits [start..end] where bit 'bit' of the codes flips, or lower bits if it doesn't
+BVHNode* buildLBVH (const std::vector<BVHPrimitive>& prims, const std::vector<MortonPrimitive>& morton, int start, int end, int bit,
+                    int maxLeafSize = BVH_MAX_LEAF_SIZE, int threadDepth = 0, BVHBuildStats* stats = nullptr) {
+    int count = end - start + 1;
+    if (count <= maxLeafSize || bit < 0) {
+        if (count == 1) { return makeBVHLeaf(Cube(prims[morton[start].index].minimums, prims[morton[start].index].maximums), start, 1); }
+        if (count <= BVH_LEAF_SIZE_LIMIT) {
+            vector3 leafMin = {INFINITY, INFINITY, INFINITY};
+            vector3 leafMax = {-INFINITY, -INFINITY, -INFINITY};
+            for (int i = start; i <= end; i++) {
+                leafMin = vectMin(leafMin, prims[morton[i].index].minimums);
+                leafMax = vectMax(leafMax, prims[morton[i].index].maximums);
+            }
+            return makeBVHLeaf(Cube(leafMin, leafMax), start, count);
+        }
+    }
+
+    int mid;
+    if (bit < 0) { mid = (start + end) / 2; } //a pile of identical codes too big for one leaf; just halve it
+    else {
+        //codes are sorted, so everything with the bit set is at the end; skip down a bit if they all agree on this one
+        uint32_t mask = 1u << bit;
+        if ((morton[start].code & mask) == (morton[end].code & mask)) {
+            return buildLBVH(prims, morton, start, end, bit - 1, maxLeafSize, threadDepth, stats);
+        }
+        int lo = start;
+        int hi = end;
+        while (lo + 1 < hi) { //first index with the bit set is in (lo, hi]
+            int m = (lo + hi) / 2;
+            if (morton[m].code & mask) { hi = m; }
+            else { lo = m; }
+        }
+        mid = lo;
+    }
+
+    BVHNode* node = new BVHNode(Cube());
+    node->axis = (bit < 0) ? 0 : bit % 3;
+    buildBVHChildren(node, count, threadDepth, stats,
+        [&](int depth) { return buildLBVH(prims, morton, start, mid, bit - 1, maxLeafSize, depth, stats); },
+        [&](int depth) { return buildLBVH(prims, morton, mid + 1, end, bit - 1, maxLeafSize, depth, stats); });
+
+    //bounds come up from the children for free, rather than looping over every primitive again
+    node->bounds = Cube(vectMin(node->left->bounds.getMinimums(), node->right->bounds.getMinimums()),
+                        vectMax(node->left->bounds.getMaximums(), node->right->bounds.getMaximums()));
+    return node;
+}
+
+// Morton codes for every primitive, relative to the bounds of all their centroids; sorted, ready for buildLBVH
+std::vector<MortonPrimitive> makeMortonPrimitives (const std::vector<BVHPrimitive>& prims) {
+    vector3 centMin = {INFINITY, INFINITY, INFINITY};
+    vector3 centMax = {-INFINITY, -INFINITY, -INFINITY};
+    for (const BVHPrimitive& p : prims) {
+        centMin = vectMin(centMin, p.centroid);
+        centMax = vectMax(centMax, p.centroid);
+    }
+
+    const double gridSize = 1 << MORTON_BITS_PER_AXIS;
+    vector3 extent = centMax - centMin;
+    std::vector<MortonPrimitive> morton(prims.size());
+    parallelFor(prims.size(), [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            vector3 cell;
+            for (int a = 0; a < 3; a++) {
+                double offset = (extent.atr[a] > 0) ? (prims[i].centroid.atr[a] - centMin.atr[a]) / extent.atr[a] : 0;
+                cell.atr[a] = std::min(gridSize - 1, offset * gridSize);
+            }
+            morton[i] = {encodeMorton(cell), i};
+        }
+    });
+
+    radixSortMorton(morton);
+    return morton;
+}
+
+//Estimated cost of tracing a random ray through the tree, relative to the cost of a single box test against the root.
+//Lower is better; handy for comparing builders without rendering anything.
+double sahCostRecursive (BVHNode* node) {
+    if (!node) { return 0; }
+    double area = node->bounds.surfaceArea();
+    if (node->isLeaf()) { return SAH_INTERSECTION_COST * area * node->primCount; }
+    return SAH_TRAVERSAL_COST * area + sahCostRecursive(node->left) + sahCostRecursive(node->right);
+}
+
+double bvhSAHCost (BVHNode* root) {
+    double rootArea = root->bounds.surfaceArea();
+    if (rootArea <= 0) { return 0; }
+    return sahCostRecursive(root) / rootArea;
+}
+
+//Same estimate for the flattened tree; the boxes are padded, so the numbers run slightly higher than for the tree it came from
+double linearBVHSAHCost (const LinearBVH* bvh) {
+    if (!bvh || bvh->nodes.empty()) { return 0; }
+    auto area = [](const LinearBVHNode& n) {
+        double x = n.maximums[0] - n.minimums[0];
+        double y = n.maximums[1] - n.minimums[1];
+        double z = n.maximums[2] - n.minimums[2];
+        return 2 * (x * y + y * z + z * x);
+    };
+
+    double rootArea = area(bvh->nodes[0]);
+    if (rootArea <= 0) { return 0; }
+    double cost = 0;
+    for (const LinearBVHNode& n : bvh->nodes) {
+        if (n.primCount > 0) { cost += SAH_INTERSECTION_COST * area(n) * n.primCount; }
+        else { cost += SAH_TRAVERSAL_COST * area(n); }
+    }
+    return cost / rootArea;
+}
+
+// Number of nodes (interior & leaf) in a hierarchy built by one of the builders
+int bvhNodeCount (BVHNode* node) {
+    if (!node) { return 0; }
+    return 1 + bvhNodeCount(node->left) + bvhNodeCount(node->right);
+}
+
+// Frees a hierarchy built by one of the builders; the shapes themselves are left alone
+void deleteBVH (BVHNode* node) {
+    if (!node) { return; }
+    deleteBVH(node->left);
+    deleteBVH(node->right);
+    delete node;
+}
+
+//primitive index array covering every shape, in scene order
+std::vector<int> makePrimIndices (int count) {
+    std::vector<int> indices(count);
+    for (int i = 0; i < count; i++) { indices[i] = i; }
+    return indices;
+}
+
+/*
+Treelet restructuring, after Karras & Aila, "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies".
+Top-down builders decide each split without knowing what comes below it, which leaves SAH cost on the table. This pass walks
+the finished tree bottom up, and at every node grows a "treelet" of up to TREELET_SIZE subtrees (always opening the biggest
+box), then finds the cheapest possible binary tree over those subtrees by trying every way of splitting every subset of them.
+If that beats the current arrangement, the treelet's interior nodes are rewired to match; nothing below the treelet changes.
+Subtrees are processed in parallel like the builds are, and several passes are made while the time budget allows; once the
+budget is spent the remaining nodes are left as they are, so the tree is always valid.
+*/
+const int TREELET_SIZE = 7;   //2^7 subsets to cost per treelet; 7 is where the quality gains flatten out in the paper
+const int TREELET_PASSES = 3;
+
+struct TreeletOptimiser {
+    std::chrono::steady_clock::time_point deadline;
+    std::atomic<int> restructured{0}; //treelets that were rearranged
+
+    //cost of node from its children's costs (or its own shapes, for a leaf)
+    static double nodeCost (BVHNode* node) {
+        double area = node->bounds.surfaceArea();
+        if (node->isLeaf()) { return SAH_INTERSECTION_COST * area * node->primCount; }
+        return SAH_TRAVERSAL_COST * area + node->left->cost + node->right->cost;
+    }
+
+    bool outOfTime () const { return std::chrono::steady_clock::now() > deadline; }
+
+    static int lowestLeaf (int set) {
+        int index = 0;
+        while (!((set >> index) & 1)) { index++; }
+        return index;
+    }
+
+    void optimise (BVHNode* root) {
+        if (root->isLeaf()) { return; }
+
+        //grow the treelet by opening up its biggest interior subtree until there are TREELET_SIZE of them
+        BVHNode* leaves[TREELET_SIZE];
+        BVHNode* interior[TREELET_SIZE - 2]; //every treelet node bar the root, which stays where it is
+        int leafCount = 2;
+        int interiorCount = 0;
+        leaves[0] = root->left;
+        leaves[1] = root->right;
+        while (leafCount < TREELET_SIZE) {
+            int best = -1;
+            double bestArea = -1;
+            for (int i = 0; i < leafCount; i++) {
+                if (leaves[i]->isLeaf()) { continue; }
+                double area = leaves[i]->bounds.surfaceArea();
+                if (area > bestArea) { best = i; bestArea = area; }
+            }
+            if (best == -1) { break; }
+            BVHNode* open = leaves[best];
+            interior[interiorCount++] = open;
+            leaves[best] = open->left;
+            leaves[leafCount++] = open->right;
+        }
+        if (leafCount < 3) { return; } //two subtrees can only go one way
+
+        //bounds & cheapest cost of every subset of the leaves; subsets are always numbered after their own subsets
+        int subsets = 1 << leafCount;
+        vector3 subsetMin[1 << TREELET_SIZE];
+        vector3 subsetMax[1 << TREELET_SIZE];
+        double subsetCost[1 << TREELET_SIZE];
+        int bestPartition[1 << TREELET_SIZE];
+        for (int set = 1; set < subsets; set++) {
+            int low = set & -set;
+            int lowIndex = lowestLeaf(set);
+            if (set == low) {
+                subsetMin[set] = leaves[lowIndex]->bounds.getMinimums();
+                subsetMax[set] = leaves[lowIndex]->bounds.getMaximums();
+                subsetCost[set] = leaves[lowIndex]->cost;
+                continue;
+            }
+            subsetMin[set] = vectMin(subsetMin[set ^ low], leaves[lowIndex]->bounds.getMinimums());
+            subsetMax[set] = vectMax(subsetMax[set ^ low], leaves[lowIndex]->bounds.getMaximums());
+
+            //each split shows up twice (as p and set ^ p), so only try the side holding the lowest leaf
+            double best = INFINITY;
+            for (int part = (set - 1) & set; part > 0; part = (part - 1) & set) {
+                if (!(part & low)) { continue; }
+                double cost = subsetCost[part] + subsetCost[set ^ part];
+                if (cost < best) { best = cost; bestPartition[set] = part; }
+            }
+            subsetCost[set] = SAH_TRAVERSAL_COST * boxSurfaceArea(subsetMin[set], subsetMax[set]) + best;
+        }
+
+        int all = subsets - 1;
+        if (subsetCost[all] >= root->cost * (1 - 1e-9)) { return; } //the rounding in the two sums shouldn't count as a win
+        int nextInterior = 0;
+        rebuild(root, all, leaves, interior, nextInterior, bestPartition, subsetMin, subsetMax);
+        restructured++;
+    }
+
+    //wires node up as the cheapest tree over the leaves in set, taking interior nodes from the treelet's spares
+    BVHNode* rebuild (BVHNode* node, int set, BVHNode* leaves[], BVHNode* interior[], int& nextInterior, const int bestPartition[],
+                      const vector3 subsetMin[], const vector3 subsetMax[]) {
+        if ((set & (set - 1)) == 0) { return leaves[lowestLeaf(set)]; }
+
+        int part = bestPartition[set];
+        BVHNode* children[2];
+        int sets[2] = {part, set ^ part};
+        for (int c = 0; c < 2; c++) {
+            BVHNode* child = ((sets[c] & (sets[c] - 1)) == 0) ? nullptr : interior[nextInterior++];
+            children[c] = rebuild(child, sets[c], leaves, interior, nextInterior, bestPartition, subsetMin, subsetMax);
+        }
+
+        //split along the axis the children are furthest apart on, nearest-first child on the left as the builders do
+        vector3 centre[2];
+        for (int c = 0; c < 2; c++) { centre[c] = (subsetMin[sets[c]] + subsetMax[sets[c]]) * 0.5; }
+        int axis = 0;
+        for (int a = 1; a < 3; a++) {
+            if (std::abs(centre[1].atr[a] - centre[0].atr[a]) > std::abs(centre[1].atr[axis] - centre[0].atr[axis])) { axis = a; }
+        }
+        if (centre[1].atr[axis] < centre[0].atr[axis]) { std::swap(children[0], children[1]); }
+
+        node->left = children[0];
+        node->right = children[1];
+        node->axis = axis;
+        node->primCount = 0;
+        node->bounds = Cube(subsetMin[set], subsetMax[set]);
+        node->cost = nodeCost(node);
+        return node;
+    }
+
+    //bottom up: a node's treelet is only worth optimising once everything under it has been
+    void pass (BVHNode* node, int threadDepth) {
+        if (node->isLeaf()) {
+            node->cost = nodeCost(node);
+            return;
+        }
+        int count = threadDepth > 0 ? bvhPrimCount(node) : 0;
+        buildBVHChildren(node, count, threadDepth, nullptr,
+            [&](int depth) { pass(node->left, depth); return node->left; },
+            [&](int depth) { pass(node->right, depth); return node->right; });
+        node->cost = nodeCost(node);
+        if (!outOfTime()) { optimise(node); }
+    }
+
+    static int bvhPrimCount (BVHNode* node) {
+        if (node->isLeaf()) { return node->primCount; }
+        return bvhPrimCount(node->left) + bvhPrimCount(node->right);
+    }
+};
+
+// Runs treelet passes over the tree until they stop helping or the time budget runs out; returns how many treelets changed
+int restructureBVH (BVHNode* root, double seconds, int threadDepth = 0) {
+    if (!root || seconds <= 0) { return 0; }
+    TreeletOptimiser optimiser;
+    optimiser.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    for (int i = 0; i < TREELET_PASSES && !optimiser.outOfTime(); i++) {
+        int before = optimiser.restructured;
+        optimiser.pass(root, threadDepth);
+        if (optimiser.restructured == before) { break; }
+    }
+    return optimiser.restructured;
+}
+
+// Everything the scene json can say about how the tree is built ("acceleration" : { ... })
+struct BVHBuildSettings {
+    std::string builder = "median";          //"median", "sah", "sbvh" or "lbvh"
+    int maxLeafSize = BVH_MAX_LEAF_SIZE;
+    double splitBudget = SBVH_SPLIT_BUDGET;  //sbvh only
+    double restructureSeconds = 0;           //time budget for treelet restructuring once built; 0 skips it
+};
+
+//Builds the hierarchy with the builder named in settings, then restructures its treelets if given the time.
+//Leaves hold up to maxLeafSize shapes, as ranges of primIndices (filled in here), which indexes into shapes.
+//The build is spread over the hardware threads; if print is set, the build time and how busy those threads were is reported,
+//along with the SAH cost of the result next to the median builder's cost for comparison.
+BVHNode* buildAccelerationHierarchy (const std::vector<Shape*>& shapes, std::vector<int>& primIndices, const BVHBuildSettings& settings,
+                                     bool print = false) {
+    //nothing to build over; LinearBVH takes a null root as an empty tree
+    if (shapes.empty()) {
+        primIndices.clear();
+        return nullptr;
+    }
+
+    std::string builder = settings.builder;
+    int maxLeafSize = std::clamp(settings.maxLeafSize, 1, BVH_LEAF_SIZE_LIMIT);
+    double splitBudget = settings.splitBudget;
+    int threadDepth = bvhThreadDepth();
+    BVHBuildStats stats;
+    auto buildStart = std::chrono::steady_clock::now();
+
+    BVHNode* root;
+    if (builder == "sah") {
+        std::vector<BVHPrimitive> prims = makeBVHPrimitives(shapes);
+        root = buildSAHBVH(prims, 0, prims.size() - 1, maxLeafSize, threadDepth, &stats);
+        primIndices.resize(prims.size());
+        for (int i = 0; i < (int) prims.size(); i++) { primIndices[i] = prims[i].index; }
+    }
+    else if (builder == "sbvh") {
+        std::vector<BVHPrimitive> refs = makeBVHPrimitives(shapes);
+        vector3 sceneMin = {INFINITY, INFINITY, INFINITY};
+        vector3 sceneMax = {-INFINITY, -INFINITY, -INFINITY};
+        for (const BVHPrimitive& ref : refs) {
+            sceneMin = vectMin(sceneMin, ref.minimums);
+            sceneMax = vectMax(sceneMax, ref.maximums);
+        }
+        SBVHBuildState state(maxLeafSize, boxSurfaceArea(sceneMin, sceneMax), shapes.size(), splitBudget);
+        root = buildSBVH(state, refs, 0, threadDepth, &stats);
+        primIndices.resize(state.leafRefs.size());
+        for (int i = 0; i < (int) state.leafRefs.size(); i++) { primIndices[i] = state.leafRefs[i].index; }
+    }
+    else if (builder == "lbvh") {
+        std::vector<BVHPrimitive> prims = makeBVHPrimitives(shapes);
+        std::vector<MortonPrimitive> morton = makeMortonPrimitives(prims);
+        root = buildLBVH(prims, morton, 0, prims.size() - 1, 3 * MORTON_BITS_PER_AXIS - 1, maxLeafSize, threadDepth, &stats);
+        primIndices.resize(prims.size());
+        for (int i = 0; i < (int) prims.size(); i++) { primIndices[i] = prims[morton[i].index].index; }
+    }
+    else {
+        if (builder != "median") { std::cout << "Unknown BVH builder '" << builder << "'; using median split." << std::endl; }
+        builder = "median";
+        primIndices = makePrimIndices(shapes.size());
+        root = buildBVH(shapes, primIndices, 0, shapes.size() - 1, maxLeafSize, threadDepth, &stats);
+    }
+    double buildSeconds = nanosecondsSince(buildStart) * 1e-9;
+
+    if (settings.restructureSeconds > 0) {
+        double before = print ? bvhSAHCost(root) : 0;
+        auto restructureStart = std::chrono::steady_clock::now();
+        int restructured = restructureBVH(root, settings.restructureSeconds, threadDepth);
+        if (print) {
+            double after = bvhSAHCost(root);
+            std::cout << "Treelet restructuring : " << restructured << " treelets rearranged in " << nanosecondsSince(restructureStart) * 1e-9
+                      << "s (budget " << settings.restructureSeconds << "s) | SAH cost " << before << " -> " << after << " ("
+                      << (1 - after / before) * 100 << "% lower)" << std::endl;
+        }
+    }
+
+    if (print) {
+        double busySeconds = buildSeconds + (stats.threadNanoseconds - stats.waitNanoseconds) * 1e-9;
+        std::cout << "BVH built in " << buildSeconds << "s on " << stats.threadsUsed << " thread(s) | utilisation : "
+                  << 100 * busySeconds / (buildSeconds * stats.threadsUsed) << "%" << std::endl;
+
+        double cost = bvhSAHCost(root);
+        std::cout << "BVH builder : " << builder << " (max leaf size " << maxLeafSize << ") | SAH cost : " << cost;
+        if (builder != "median") {
+            std::vector<int> medianIndices = makePrimIndices(shapes.size());
+            BVHNode* medianRoot = buildBVH(shapes, medianIndices, 0, shapes.size() - 1, maxLeafSize);
+            double medianCost = bvhSAHCost(medianRoot);
+            std::cout << " (median split : " << medianCost << ", " << (1 - cost / medianCost) * 100 << "% lower)";
+            deleteBVH(medianRoot);
+        }
+        std::cout << std::endl;
+
+        if (builder == "sbvh") {
+            //what the duplicated references cost in memory, against what they save over the same build without spatial splits
+            std::vector<BVHPrimitive> prims = makeBVHPrimitives(shapes);
+            BVHNode* sahRoot = buildSAHBVH(prims, 0, prims.size() - 1, maxLeafSize);
+            double sahCost = bvhSAHCost(sahRoot);
+            int nodes = bvhNodeCount(root);
+            int sahNodes = bvhNodeCount(sahRoot);
+            int references = primIndices.size();
+            size_t bytes = nodes * sizeof(LinearBVHNode) + references * (sizeof(Shape*) + sizeof(int));
+            size_t sahBytes = sahNodes * sizeof(LinearBVHNode) + shapes.size() * (sizeof(Shape*) + sizeof(int));
+            std::cout << "Spatial splits : " << references << " references for " << shapes.size() << " shapes (+"
+                      << 100.0 * (references - (int) shapes.size()) / std::max<size_t>(1, shapes.size()) << "%, budget "
+                      << 100 * splitBudget << "%) | " << nodes << " nodes vs " << sahNodes << " | " << bytes / 1024.0 << "KB vs "
+                      << sahBytes / 1024.0 << "KB | SAH cost " << (1 - cost / sahCost) * 100 << "% lower than object splits only ("
+                      << sahCost << ")" << std::endl;
+            deleteBVH(sahRoot);
+        }
+    }
+
+    return root;
+}
+
 #endif
\ No newline at end of file
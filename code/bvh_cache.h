@@ -0,0 +1,196 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include "vector_helper.h"
+#include "shape.h"
+#include "acceleration hierarchy.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BVH_CACHE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+==================================================================================================
+BVH cache: the flattened hierarchy is written out next to the scene file, so re-rendering the same heavy scene (with a
+different camera, sample count, etc.) can skip building it.
+The file is keyed by a hash of everything the build depends on: the shape types, bounds and centers, triangles' vertices
+(spatial splits clip leaf boxes to them, so two triangles with the same box can still need different trees), and the builder
+settings. Anything else in the scene (the camera included) can change freely.
+
+Layout: a BVHCacheHeader, then the LinearBVHNodes as they are in memory, then primOrder (which shape each leaf slot holds).
+The file is memory mapped where mmap is available and read normally otherwise; it only makes sense on the machine that
+wrote it, since nothing is byte swapped.
+==================================================================================================
+*/
+
+const char BVH_CACHE_MAGIC[8] = {'R', 'T', 'B', 'V', 'H', 'C', '0', '1'}; //bump the number whenever the node layout changes
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint64_t hash;
+    uint32_t nodeCount;
+    uint32_t primCount;
+    int32_t maxDepth;
+    int32_t padding;
+    double builtCost;
+};
+
+// FNV-1a; nothing fancy, just has to notice when the geometry changes
+class GeometryHasher {
+    public:
+        uint64_t hash;
+
+        GeometryHasher () : hash(14695981039346656037ull) {}
+
+        void add (const void* data, size_t size) {
+            const unsigned char* bytes = (const unsigned char*) data;
+            for (size_t i = 0; i < size; i++) {
+                hash ^= bytes[i];
+                hash *= 1099511628211ull;
+            }
+        }
+        void add (const vector3& v) { add(v.atr, sizeof(v.atr)); }
+        void add (const std::string& s) { add(s.data(), s.size() + 1); } //with the terminator, so "ab" + "c" != "a" + "bc"
+        void add (int i) { add(&i, sizeof(i)); }
+        void add (double d) { add(&d, sizeof(d)); }
+};
+
+uint64_t hashSceneGeometry (const std::vector<Shape*>& shapes, const BVHBuildSettings& settings) {
+    GeometryHasher h;
+    h.add(settings.builder);
+    h.add(settings.maxLeafSize);
+    h.add(settings.splitBudget);
+    h.add(settings.restructureSeconds);
+    h.add((int) shapes.size());
+    for (Shape* s : shapes) {
+        h.add(s->getType());
+        h.add(s->getMinimums());
+        h.add(s->getMaximums());
+        h.add(s->getCenter());
+        if (s->getType() == "tri") {
+            const Triangle* tri = static_cast<const Triangle*>(s);
+            for (int v = 0; v < 3; v++) { h.add(tri->getVertex(v)); }
+        }
+    }
+    return h.hash;
+}
+
+// Writes bvh out to path; goes via a temporary file, so a half written cache never gets left behind
+bool writeBVHCache (const std::string& path, uint64_t hash, const LinearBVH* bvh) {
+    std::string tempPath = path + ".tmp";
+    std::ofstream out(tempPath, std::ios::binary);
+    if (!out.is_open()) { return false; }
+
+    BVHCacheHeader header;
+    std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.hash = hash;
+    header.nodeCount = bvh->nodes.size();
+    header.primCount = bvh->primOrder.size();
+    header.maxDepth = bvh->maxDepth;
+    header.padding = 0;
+    header.builtCost = bvh->builtCost;
+
+    out.write((const char*) &header, sizeof(header));
+    out.write((const char*) bvh->nodes.data(), bvh->nodes.size() * sizeof(LinearBVHNode));
+    out.write((const char*) bvh->primOrder.data(), bvh->primOrder.size() * sizeof(int));
+    out.close();
+    if (!out) {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+// True if traversal can walk the nodes read in without leaving the arrays: interior nodes have both children after them (as
+// the builders lay them out) and split along a real axis, leaves' ranges lie within primOrder, and the traversal stack sized
+// by maxDepth is deep enough
+bool validBVHNodes (const LinearBVH& bvh) {
+    int nodeCount = bvh.nodes.size();
+    int primCount = bvh.primOrder.size();
+    std::vector<int> depth(nodeCount, 0);
+    for (int index = 0; index < nodeCount; index++) {
+        const LinearBVHNode& node = bvh.nodes[index];
+        if (node.primCount > 0) {
+            if (node.offset < 0 || node.offset + node.primCount > primCount || depth[index] > bvh.maxDepth) { return false; }
+            continue;
+        }
+        if (node.offset <= index + 1 || node.offset >= nodeCount || node.axis > 2) { return false; }
+        depth[index + 1] = std::max(depth[index + 1], depth[index] + 1);
+        depth[node.offset] = std::max(depth[node.offset], depth[index] + 1);
+    }
+    return true;
+}
+
+// Builds a LinearBVH over shapes from a mapped (or read in) cache file; nullptr if it's for different geometry or is broken
+LinearBVH* readBVHCache (const char* data, size_t size, uint64_t hash, const std::vector<Shape*>& shapes) {
+    if (size < sizeof(BVHCacheHeader)) { return nullptr; }
+    BVHCacheHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.hash != hash) { return nullptr; }
+    if (header.primCount < shapes.size() || header.nodeCount == 0) { return nullptr; } //spatial splits can reference a shape more than once
+    if (size != sizeof(header) + header.nodeCount * sizeof(LinearBVHNode) + header.primCount * sizeof(int)) { return nullptr; }
+
+    LinearBVH* bvh = new LinearBVH();
+    const LinearBVHNode* nodes = (const LinearBVHNode*) (data + sizeof(header));
+    const int* primOrder = (const int*) (data + sizeof(header) + header.nodeCount * sizeof(LinearBVHNode));
+    bvh->nodes.assign(nodes, nodes + header.nodeCount);
+    bvh->primOrder.assign(primOrder, primOrder + header.primCount);
+    bvh->maxDepth = header.maxDepth;
+    bvh->builtCost = header.builtCost;
+
+    if (!validBVHNodes(*bvh)) {
+        delete bvh;
+        return nullptr;
+    }
+
+    bvh->prims.resize(header.primCount);
+    for (uint32_t i = 0; i < header.primCount; i++) {
+        if (bvh->primOrder[i] < 0 || bvh->primOrder[i] >= (int) shapes.size()) {
+            delete bvh;
+            return nullptr;
+        }
+        bvh->prims[i] = shapes[bvh->primOrder[i]];
+    }
+    return bvh;
+}
+
+// Loads the cache at path if there is one matching hash; nullptr otherwise (so the caller builds the BVH as usual)
+LinearBVH* loadBVHCache (const std::string& path, uint64_t hash, const std::vector<Shape*>& shapes) {
+#if defined(BVH_CACHE_MMAP)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) { return nullptr; }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) { return nullptr; }
+
+    LinearBVH* bvh = readBVHCache((const char*) mapped, info.st_size, hash, shapes);
+    munmap(mapped, info.st_size);
+    return bvh;
+#else
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) { return nullptr; }
+    std::vector<char> data(in.tellg());
+    in.seekg(0);
+    in.read(data.data(), data.size());
+    if (!in) { return nullptr; }
+    return readBVHCache(data.data(), data.size(), hash, shapes);
+#endif
+}
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef BVH_COMPRESSED_H
+#define BVH_COMPRESSED_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <list>
+#include <vector>
+#include "vector_helper.h"
+#include "shape.h"
+#include "ray.h"
+#include "acceleration hierarchy.h"
+
+/*
+==================================================================================================
+Compressed BVH: the binary tree again, but with every child box quantized to 8 or 16 bits per plane relative to its parent's box.
+Each node holds both children of a binary interior node, so leaves are stored inline in their parent and never get a node of
+their own; with 8 bit planes two children take 40 bytes where the flattened tree spends 64 on them (52 with 16 bits).
+It's built from the flattened tree (like the 4-wide one), so it can be picked with "acceleration" : { "compress" : 8 / 16 }
+on top of any builder, cached tree or refit.
+
+Decoding a plane is origin + q * 2^exponent in floats. q * 2^exponent is always exact (q fits easily in a float's mantissa),
+which leaves only the one rounding in the add - so the encoder can run exactly the same sum to check its rounding, nudging q
+down for minimums and up for maximums until the decoded box is sure to hold the real one. Boxes only ever grow.
+==================================================================================================
+*/
+
+template <typename Q>
+struct QuantizedBVHNode {
+    float origin[3];     //minimum corner of the parent box
+    int8_t exponent[3];  //the parent box is split into steps of 2^exponent along each axis
+    uint8_t padding;
+    Q minimums[2][3];    //per child; decoded with quantizedPlane()
+    Q maximums[2][3];
+    int32_t child[2];    //leaf: index of its first primitive | interior: index of its node | -1 for no child at all
+    uint16_t primCount[2];
+};
+static_assert(sizeof(QuantizedBVHNode<uint8_t>) == 40, "8 bit compressed nodes should be 40 bytes");
+static_assert(sizeof(QuantizedBVHNode<uint16_t>) == 52, "16 bit compressed nodes should be 52 bytes");
+
+// 2^exponent, straight from the float's bits; exponent is kept within the range of normal floats
+inline float quantizedScale (int exponent) {
+    uint32_t bits = (uint32_t) (exponent + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+inline float quantizedPlane (float origin, int q, float scale) { return origin + (float) q * scale; }
+
+class CompressedBVH {
+    public:
+        int bits; //8 or 16
+        std::vector<QuantizedBVHNode<uint8_t>> nodes8;   //only the one matching bits is filled
+        std::vector<QuantizedBVHNode<uint16_t>> nodes16;
+        std::vector<Shape*> prims; //same leaf order as the binary tree it was built from
+        int maxDepth;
+
+        CompressedBVH (const LinearBVH& binary, int b) : bits(b == 8 ? 8 : 16), prims(binary.prims), maxDepth(0) {
+            if (binary.nodes.empty()) { return; }
+            if (bits == 8) { build(binary, nodes8); }
+            else { build(binary, nodes16); }
+        }
+
+        size_t nodeCount () const { return bits == 8 ? nodes8.size() : nodes16.size(); }
+        size_t memoryBytes () const {
+            return nodes8.size() * sizeof(nodes8[0]) + nodes16.size() * sizeof(nodes16[0]) + prims.size() * sizeof(Shape*);
+        }
+
+    private:
+        template <typename Q>
+        void build (const LinearBVH& binary, std::vector<QuantizedBVHNode<Q>>& out) {
+            out.push_back(QuantizedBVHNode<Q>());
+            encode(binary, out, 0, 0, 0);
+        }
+
+        //packs the children of binary node binaryIndex into out[index]; the root node of a tree that is one big leaf just
+        //holds that leaf, so traversal can always start at node 0
+        template <typename Q>
+        void encode (const LinearBVH& binary, std::vector<QuantizedBVHNode<Q>>& out, int binaryIndex, int index, int depth) {
+            const int qMax = std::numeric_limits<Q>::max();
+            maxDepth = std::max(maxDepth, depth);
+            const LinearBVHNode& parent = binary.nodes[binaryIndex];
+
+            int children[2];
+            int count = 0;
+            if (parent.primCount > 0) { children[count++] = binaryIndex; }
+            else {
+                children[count++] = binaryIndex + 1;
+                children[count++] = parent.offset;
+            }
+
+            QuantizedBVHNode<Q> node;
+            node.padding = 0;
+            for (int a = 0; a < 3; a++) {
+                float lo = INFINITY;
+                float hi = -INFINITY;
+                for (int i = 0; i < count; i++) {
+                    lo = std::min(lo, binary.nodes[children[i]].minimums[a]);
+                    hi = std::max(hi, binary.nodes[children[i]].maximums[a]);
+                }
+
+                //smallest power of two step that gets from lo to hi in qMax steps (checked with the real decode)
+                double extent = (double) hi - lo;
+                int exponent = extent > 0 ? (int) std::ceil(std::log2(extent / qMax)) : -126;
+                exponent = std::clamp(exponent, -126, 127);
+                while (exponent < 127 && quantizedPlane(lo, qMax, quantizedScale(exponent)) < hi) { exponent++; }
+                node.origin[a] = lo;
+                node.exponent[a] = exponent;
+            }
+
+            for (int i = 0; i < 2; i++) {
+                if (i >= count) {
+                    node.child[i] = -1;
+                    node.primCount[i] = 0;
+                    for (int a = 0; a < 3; a++) {
+                        node.minimums[i][a] = qMax;
+                        node.maximums[i][a] = 0;
+                    }
+                    continue;
+                }
+
+                const LinearBVHNode& child = binary.nodes[children[i]];
+                for (int a = 0; a < 3; a++) {
+                    float origin = node.origin[a];
+                    float scale = quantizedScale(node.exponent[a]);
+                    int lo = std::clamp((int) std::floor(((double) child.minimums[a] - origin) / scale), 0, qMax);
+                    while (lo > 0 && quantizedPlane(origin, lo, scale) > child.minimums[a]) { lo--; }
+                    int hi = std::clamp((int) std::ceil(((double) child.maximums[a] - origin) / scale), 0, qMax);
+                    while (hi < qMax && quantizedPlane(origin, hi, scale) < child.maximums[a]) { hi++; }
+                    node.minimums[i][a] = lo;
+                    node.maximums[i][a] = hi;
+                }
+
+                if (child.primCount > 0) {
+                    node.child[i] = child.offset;
+                    node.primCount[i] = child.primCount;
+                }
+                else {
+                    node.child[i] = out.size();
+                    node.primCount[i] = 0;
+                    out.push_back(QuantizedBVHNode<Q>());
+                }
+            }
+            out[index] = node; //can't hold a reference over the push_backs / recursion; the vector may have moved
+
+            for (int i = 0; i < count; i++) {
+                if (node.primCount[i] == 0) { encode(binary, out, children[i], node.child[i], depth + 1); }
+            }
+        }
+};
+
+/*
+Slab test of a ray against both children of a compressed node, decoding the boxes on the way.
+Returns a bitmask of the children hit between the ray's tMin and maxT, with the entry distance of each in tNear; NaN slab distances are
+ignored, as in the other slab tests.
+*/
+template <typename Q>
+int intersectQuantizedChildren (const QuantizedBVHNode<Q>& node, const BVH4Ray& ray, float maxT, float tNear[2]) {
+    float scale[3];
+    for (int a = 0; a < 3; a++) { scale[a] = quantizedScale(node.exponent[a]); }
+
+    int mask = 0;
+    for (int c = 0; c < 2; c++) {
+        if (node.child[c] < 0) { continue; }
+        float tEntry = ray.tMin;
+        float tExit = maxT;
+        for (int a = 0; a < 3; a++) {
+            float lo = quantizedPlane(node.origin[a], node.minimums[c][a], scale[a]);
+            float hi = quantizedPlane(node.origin[a], node.maximums[c][a], scale[a]);
+            float t0 = ((ray.dirIsNeg[a] ? hi : lo) - ray.origin[a]) * ray.invDirection[a];
+            float t1 = ((ray.dirIsNeg[a] ? lo : hi) - ray.origin[a]) * ray.invDirection[a];
+            if (t0 > tEntry) { tEntry = t0; }
+            if (t1 < tExit) { tExit = t1; }
+        }
+        tNear[c] = tEntry;
+        if (tEntry <= tExit) { mask |= 1 << c; }
+    }
+    return mask;
+}
+
+// Closest shape through the compressed nodes; same stack & ordering as the 4-wide traversal, with leaves pushed too
+template <typename Q>
+Shape* findClosestQuantized (const CompressedBVH* bvh, const std::vector<QuantizedBVHNode<Q>>& nodes, Ray& ray, int& checks) {
+    BVH4Ray quantizedRay = BVH4Ray(ray);
+    BVH4StackEntry stackBuffer[BVH_STACK_SIZE];
+    std::vector<BVH4StackEntry> bigStack;
+    BVH4StackEntry* stack = stackBuffer;
+    if (bvh->maxDepth + 4 > BVH_STACK_SIZE) { //every level nets at most 1 more entry
+        bigStack.resize(bvh->maxDepth + 4);
+        stack = bigStack.data();
+    }
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0};
+
+    Shape* closestShape = nullptr;
+    while (stackSize > 0) {
+        BVH4StackEntry entry = stack[--stackSize];
+        if (entry.tNear > ray.getTMax()) { continue; }
+        checks++;
+
+        if (entry.primCount > 0) {
+            for (int i = entry.offset; i < entry.offset + entry.primCount; i++) {
+                double t = bvh->prims[i]->hitDistance(ray);
+                if (t >= 0 && (!closestShape || t < ray.getTMax())) {
+                    ray.setTMax(t);
+                    closestShape = bvh->prims[i];
+                }
+            }
+            continue;
+        }
+
+        const QuantizedBVHNode<Q>& node = nodes[entry.offset];
+        float tNear[2];
+        int mask = intersectQuantizedChildren(node, quantizedRay, (float) ray.getTMax(), tNear);
+        if (mask == 3) {
+            int first = tNear[1] < tNear[0] ? 1 : 0; //nearest goes on last, so it's popped next
+            stack[stackSize++] = {node.child[1 - first], node.primCount[1 - first], tNear[1 - first]};
+            stack[stackSize++] = {node.child[first], node.primCount[first], tNear[first]};
+        }
+        else if (mask) {
+            int c = mask == 1 ? 0 : 1;
+            stack[stackSize++] = {node.child[c], node.primCount[c], tNear[c]};
+        }
+    }
+    return closestShape;
+}
+
+template <typename Q>
+Shape* findOccluderQuantized (const CompressedBVH* bvh, const std::vector<QuantizedBVHNode<Q>>& nodes, Ray& ray, int ignoreID,
+                              int ignoreInstanceID) {
+    BVH4Ray quantizedRay = BVH4Ray(ray);
+    int stackBuffer[BVH_STACK_SIZE];
+    std::vector<int> bigStack;
+    int* stack = stackBuffer;
+    if (bvh->maxDepth + 4 > BVH_STACK_SIZE) {
+        bigStack.resize(bvh->maxDepth + 4);
+        stack = bigStack.data();
+    }
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const QuantizedBVHNode<Q>& node = nodes[stack[--stackSize]];
+        float tNear[2];
+        int mask = intersectQuantizedChildren(node, quantizedRay, (float) ray.getTMax(), tNear);
+
+        for (int c = 0; c < 2; c++) {
+            if (!(mask & (1 << c))) { continue; }
+            if (node.primCount[c] == 0) {
+                stack[stackSize++] = node.child[c];
+                continue;
+            }
+            for (int i = node.child[c]; i < node.child[c] + node.primCount[c]; i++) {
+                Shape* s = bvh->prims[i];
+                if (s->occludes(ray, ignoreID, ignoreInstanceID)) { return s; }
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Closest hit through the compressed BVH; same rules as the binary intersectBVH
+Hit intersectBVH(Ray& ray, const std::list<LightSource*>& l, const vector3& look, const CompressedBVH* bvh, bool calcMaterial = true) {
+    if (!bvh || bvh->nodeCount() == 0) {
+        Hit h = Hit();
+        h.setChecks(1);
+        return h;
+    }
+
+    guardSecondaryRay(ray, calcMaterial);
+    int checks = 0;
+    Shape* closestShape;
+    if (bvh->bits == 8) { closestShape = findClosestQuantized(bvh, bvh->nodes8, ray, checks); }
+    else { closestShape = findClosestQuantized(bvh, bvh->nodes16, ray, checks); }
+
+    if (!closestShape) {
+        Hit h = Hit();
+        h.setChecks(checks);
+        return h;
+    }
+
+    Hit h = closestShape->intersect(ray, l, look, calcMaterial);
+    h.setChecks(checks);
+    return h;
+}
+
+// Any-hit shadow query through the compressed BVH; same rules as the binary findOccluder
+Shape* findOccluder (const CompressedBVH* bvh, Ray& ray, int ignoreID, int ignoreInstanceID = -1) {
+    if (!bvh || bvh->nodeCount() == 0) { return nullptr; }
+    if (bvh->bits == 8) { return findOccluderQuantized(bvh, bvh->nodes8, ray, ignoreID, ignoreInstanceID); }
+    return findOccluderQuantized(bvh, bvh->nodes16, ray, ignoreID, ignoreInstanceID);
+}
+
+#endif
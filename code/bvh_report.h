@@ -0,0 +1,135 @@
+#ifndef BVH_REPORT_H
+#define BVH_REPORT_H
+
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <algorithm>
+#include "nlohmann/json.hpp"
+#include "acceleration hierarchy.h"
+#include "bvh_compressed.h"
+
+using json = nlohmann::json;
+
+/*
+==================================================================================================
+BVH quality report: a summary of the flattened hierarchy, as JSON so it can be saved & compared between builders and scenes.
+It's taken from the tree the renderer actually uses (so it covers cached & refitted trees too), and holds:
+ - node, leaf & reference counts (references can outnumber shapes once spatial splits duplicate some)
+ - the deepest & average leaf depth, and a histogram of how many shapes the leaves hold
+ - the SAH cost, and what it works out to per ray: the expected node visits & shape tests for a ray through the root box
+ - how much sibling boxes overlap, as a fraction of their parent's surface area; overlap is what forces rays down both sides
+ - the memory taken by the nodes & leaf lists (and the 4-wide or compressed tree, when there is one)
+==================================================================================================
+*/
+
+double linearNodeArea (const LinearBVHNode& n) {
+    double x = std::max(0.0f, n.maximums[0] - n.minimums[0]);
+    double y = std::max(0.0f, n.maximums[1] - n.minimums[1]);
+    double z = std::max(0.0f, n.maximums[2] - n.minimums[2]);
+    return 2 * (x * y + y * z + z * x);
+}
+
+// Surface area of the region shared by two node boxes (0 if they don't touch)
+double linearNodeOverlapArea (const LinearBVHNode& a, const LinearBVHNode& b) {
+    double d[3];
+    for (int i = 0; i < 3; i++) {
+        d[i] = std::min(a.maximums[i], b.maximums[i]) - std::max(a.minimums[i], b.minimums[i]);
+        if (d[i] <= 0) { return 0; }
+    }
+    return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+json bvhReport (const LinearBVH* bvh, const LinearBVH4* wide = nullptr, const CompressedBVH* compressed = nullptr) {
+    json report;
+    if (!bvh || bvh->nodes.empty()) {
+        report["nodes"] = 0;
+        return report;
+    }
+
+    //children always come after their parent, so one forward pass is enough to hand depths down the tree
+    const std::vector<LinearBVHNode>& nodes = bvh->nodes;
+    std::vector<int> depth(nodes.size(), 0);
+    int leaves = 0;
+    int maxDepth = 0;
+    double leafDepthSum = 0;
+    std::map<int, int> leafSizes;
+    double rootArea = linearNodeArea(nodes[0]);
+    double expectedVisits = 0;
+    double expectedTests = 0;
+    double overlapRatioSum = 0;
+    double overlapArea = 0;
+    double parentArea = 0;
+    for (int i = 0; i < (int) nodes.size(); i++) {
+        const LinearBVHNode& node = nodes[i];
+        double area = linearNodeArea(node);
+        expectedVisits += area;
+        maxDepth = std::max(maxDepth, depth[i]);
+
+        if (node.primCount > 0) {
+            leaves++;
+            leafDepthSum += depth[i];
+            leafSizes[node.primCount]++;
+            expectedTests += area * node.primCount;
+            continue;
+        }
+
+        depth[i + 1] = depth[i] + 1;
+        depth[node.offset] = depth[i] + 1;
+        double overlap = linearNodeOverlapArea(nodes[i + 1], nodes[node.offset]);
+        if (area > 0) { overlapRatioSum += overlap / area; }
+        overlapArea += overlap;
+        parentArea += area;
+    }
+    int interior = nodes.size() - leaves;
+
+    //count each shape once, however many leaves it's in. A tree without a primOrder falls back to counting the distinct
+    //shapes the leaves point at
+    int shapeCount = 0;
+    if (!bvh->primOrder.empty()) {
+        std::vector<bool> seen;
+        for (int index : bvh->primOrder) {
+            if (index >= (int) seen.size()) { seen.resize(index + 1, false); }
+            if (!seen[index]) { seen[index] = true; shapeCount++; }
+        }
+    }
+    else {
+        std::unordered_set<const Shape*> seen(bvh->prims.begin(), bvh->prims.end());
+        shapeCount = seen.size();
+    }
+
+    report["nodes"] = nodes.size();
+    report["interiorNodes"] = interior;
+    report["leaves"] = leaves;
+    report["shapes"] = shapeCount;
+    report["references"] = bvh->prims.size();
+    report["depth"] = {{"max", maxDepth}, {"averageLeaf", leafDepthSum / leaves}};
+
+    json histogram = json::object();
+    for (const auto& [size, count] : leafSizes) { histogram[std::to_string(size)] = count; }
+    report["leafSizeHistogram"] = histogram;
+
+    report["sahCost"] = linearBVHSAHCost(bvh);
+    report["builtSahCost"] = bvh->builtCost;
+    if (rootArea > 0) {
+        report["perRay"] = {{"nodeVisits", expectedVisits / rootArea}, {"shapeTests", expectedTests / rootArea}};
+    }
+    report["siblingOverlap"] = {
+        {"mean", interior > 0 ? overlapRatioSum / interior : 0.0},           //every parent counts the same
+        {"areaWeighted", parentArea > 0 ? overlapArea / parentArea : 0.0}    //big nodes (which more rays reach) count for more
+    };
+
+    size_t nodeBytes = nodes.size() * sizeof(LinearBVHNode);
+    size_t primBytes = bvh->prims.size() * sizeof(Shape*) + bvh->primOrder.size() * sizeof(int);
+    size_t wideBytes = wide ? wide->nodes.size() * sizeof(BVH4Node) + wide->prims.size() * sizeof(Shape*) : 0;
+    size_t compressedBytes = compressed ? compressed->memoryBytes() : 0;
+    report["memoryBytes"] = {{"nodes", nodeBytes}, {"primitives", primBytes}, {"wide", wideBytes}, {"compressed", compressedBytes},
+                             {"total", nodeBytes + primBytes + wideBytes + compressedBytes}};
+    if (wide) { report["wideNodes"] = wide->nodes.size(); }
+    if (compressed) { report["compressedNodes"] = compressed->nodeCount(); }
+
+    return report;
+}
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef DYNAMIC_BVH_H
+#define DYNAMIC_BVH_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "vector_helper.h"
+#include "shape.h"
+#include "acceleration hierarchy.h"
+
+/*
+==================================================================================================
+Dynamic BVH: a tree that takes shapes being added, removed and moved one at a time, for scenes edited between renders.
+Every shape has a leaf of its own. A new leaf goes in beside whichever node adds the least surface area to the tree as a whole;
+that's found with a branch & bound search down from the root (Bittner, Hapala & Havran, "Fast Insertion-Based Optimization of
+Bounding Volume Hierarchies"), which only opens nodes that could still beat the best spot found so far. A removed leaf's
+sibling takes its parent's place. Either way the boxes above are refitted on the way back up to the root, and at each of those
+nodes a tree rotation (Kopta et al., "Fast, Effective BVH Updates for Animated Scenes") swaps a child with a grandchild if that
+shrinks the boxes; the local fixes keep the tree close to a fresh build however many edits go in. Moving is a remove & insert.
+
+The renderer still walks a LinearBVH; flatten() writes the tree out into one, merging small subtrees back into multi-shape
+leaves where the SAH says so. That is one pass over the tree - nothing like a rebuild.
+==================================================================================================
+*/
+
+struct DynamicBVHNode {
+    vector3 minimums;
+    vector3 maximums;
+    int parent;      //-1 at the root; on the free list, the next free node
+    int children[2]; //-1 in leaves
+    Shape* shape;    //leaves only
+    int order;       //leaves only: where the shape comes in the tree's shape list (see shapes())
+
+    bool isLeaf () const { return children[0] < 0; }
+};
+
+class DynamicBVH {
+    public:
+        std::vector<DynamicBVHNode> nodes; //node pool; removed nodes are reused, so a node's index never changes while it's in use
+        int root;
+        std::unordered_map<const Shape*, int> leaves; //the leaf holding each shape
+        long rotations;                                //rotations made so far, for reporting
+
+        DynamicBVH () : root(-1), rotations(0), freeNodes(-1), nextOrder(0) {}
+        //takes over the tree of a built BVH; leaves holding several shapes are split in two until each has one.
+        //a shape a spatial split put in more than one leaf keeps only the first
+        DynamicBVH (const LinearBVH& bvh) : DynamicBVH() {
+            if (!bvh.nodes.empty()) { root = adopt(bvh, 0); }
+        }
+
+        int size () const { return leaves.size(); }
+
+        //each returns false (and leaves the tree alone) if the edit makes no sense - adding a shape that's already in the
+        //tree, or removing / moving one that isn't
+        bool insert (Shape* shape) {
+            if (!shape || leaves.count(shape)) { return false; }
+            int leaf = makeLeaf(shape, nextOrder);
+            insertLeaf(leaf);
+            return true;
+        }
+
+        bool remove (Shape* shape) {
+            auto found = leaves.find(shape);
+            if (found == leaves.end()) { return false; }
+            int leaf = found->second;
+            leaves.erase(found);
+            removeLeaf(leaf);
+            release(leaf);
+            return true;
+        }
+
+        //moved takes the place of shape: either shape itself after being changed, or a new shape standing in for it
+        bool move (Shape* shape, Shape* moved) {
+            auto found = leaves.find(shape);
+            if (found == leaves.end() || !moved || (moved != shape && leaves.count(moved))) { return false; }
+            int leaf = found->second;
+            leaves.erase(found);
+            removeLeaf(leaf);
+            nodes[leaf].shape = moved;
+            nodes[leaf].minimums = moved->getMinimums();
+            nodes[leaf].maximums = moved->getMaximums();
+            leaves[moved] = leaf;
+            insertLeaf(leaf);
+            return true;
+        }
+
+        //every shape in the tree: the shapes of the BVH it took over in their scene order, less any removed, then the inserted
+        //ones in the order they went in. A moved shape keeps its place. The primOrder flatten() writes indexes into this list
+        std::vector<Shape*> shapes () const {
+            std::vector<std::pair<int, Shape*>> ordered;
+            ordered.reserve(leaves.size());
+            for (const DynamicBVHNode& node : nodes) {
+                if (node.isLeaf() && node.shape) { ordered.push_back({node.order, node.shape}); }
+            }
+            std::sort(ordered.begin(), ordered.end());
+
+            std::vector<Shape*> list;
+            list.reserve(ordered.size());
+            for (const auto& [order, shape] : ordered) { list.push_back(shape); }
+            return list;
+        }
+
+        //writes the tree out into bvh (replacing what it held) for the renderer. Subtrees of up to maxLeafSize shapes become a
+        //single leaf when the SAH reckons testing every shape beats opening the boxes. The written tree's primOrder indexes
+        //into shapes(), and its builtCost is its cost as written, so a later frame can still refit it
+        void flatten (LinearBVH& bvh, int maxLeafSize = BVH_MAX_LEAF_SIZE) const {
+            bvh.nodes.clear();
+            bvh.prims.clear();
+            bvh.primOrder.clear();
+            bvh.maxDepth = 0;
+            bvh.builtCost = 0;
+            if (root < 0) { return; }
+
+            std::vector<int> shapeCount(nodes.size(), 0);
+            std::vector<char> asLeaf(nodes.size(), 0);
+            planLeaves(root, maxLeafSize, shapeCount, asLeaf);
+            bvh.nodes.reserve(2 * shapeCount[root]);
+            bvh.prims.reserve(shapeCount[root]);
+            bvh.primOrder.reserve(shapeCount[root]);
+            emit(bvh, root, 0, asLeaf);
+
+            //leaves carry their shape's order with gaps where shapes were removed; close them up to index into shapes()
+            std::vector<int> sorted = bvh.primOrder;
+            std::sort(sorted.begin(), sorted.end());
+            for (int& order : bvh.primOrder) { order = std::lower_bound(sorted.begin(), sorted.end(), order) - sorted.begin(); }
+            bvh.builtCost = linearBVHSAHCost(&bvh);
+        }
+
+    private:
+        int freeNodes; //head of the free list
+        int nextOrder; //order the next inserted shape gets; past every order in the tree
+
+        int allocate () {
+            int index;
+            if (freeNodes >= 0) {
+                index = freeNodes;
+                freeNodes = nodes[index].parent;
+            }
+            else {
+                index = nodes.size();
+                nodes.push_back(DynamicBVHNode());
+            }
+            nodes[index].parent = -1;
+            nodes[index].children[0] = nodes[index].children[1] = -1;
+            nodes[index].shape = nullptr;
+            nodes[index].order = -1;
+            return index;
+        }
+
+        void release (int index) {
+            nodes[index].parent = freeNodes;
+            nodes[index].children[0] = nodes[index].children[1] = -1;
+            nodes[index].shape = nullptr;
+            freeNodes = index;
+        }
+
+        int makeLeaf (Shape* shape, int order) {
+            int leaf = allocate();
+            nodes[leaf].shape = shape;
+            nodes[leaf].order = order;
+            nextOrder = std::max(nextOrder, order + 1);
+            nodes[leaf].minimums = shape->getMinimums();
+            nodes[leaf].maximums = shape->getMaximums();
+            leaves[shape] = leaf;
+            return leaf;
+        }
+
+        double area (int index) const { return boxSurfaceArea(nodes[index].minimums, nodes[index].maximums); }
+
+        double unionArea (int a, int b) const {
+            return boxSurfaceArea(vectMin(nodes[a].minimums, nodes[b].minimums), vectMax(nodes[a].maximums, nodes[b].maximums));
+        }
+
+        void fitToChildren (int index) {
+            DynamicBVHNode& node = nodes[index];
+            node.minimums = vectMin(nodes[node.children[0]].minimums, nodes[node.children[1]].minimums);
+            node.maximums = vectMax(nodes[node.children[0]].maximums, nodes[node.children[1]].maximums);
+        }
+
+        //points parent (or the root, if parent is -1) at replacement instead of child
+        void replaceChild (int parent, int child, int replacement) {
+            if (parent < 0) { root = replacement; }
+            else if (nodes[parent].children[0] == child) { nodes[parent].children[0] = replacement; }
+            else { nodes[parent].children[1] = replacement; }
+            nodes[replacement].parent = parent;
+        }
+
+        //a new interior node over left & right; either may be -1 (nothing), in which case the other is passed straight back
+        int join (int left, int right) {
+            if (left < 0) { return right; }
+            if (right < 0) { return left; }
+            int index = allocate();
+            nodes[index].children[0] = left;
+            nodes[index].children[1] = right;
+            nodes[left].parent = index;
+            nodes[right].parent = index;
+            fitToChildren(index);
+            return index;
+        }
+
+        int adopt (const LinearBVH& bvh, int index) {
+            const LinearBVHNode& node = bvh.nodes[index];
+            if (node.primCount > 0) { return adoptLeaf(bvh, node.offset, node.offset + node.primCount); }
+            int left = adopt(bvh, index + 1);
+            return join(left, adopt(bvh, node.offset));
+        }
+
+        //shapes keep their place in the scene's shape list where the BVH has a primOrder, and their place in its leaves if not
+        int adoptLeaf (const LinearBVH& bvh, int start, int end) {
+            if (end - start == 1) {
+                if (leaves.count(bvh.prims[start])) { return -1; }
+                bool ordered = bvh.primOrder.size() == bvh.prims.size();
+                return makeLeaf(bvh.prims[start], ordered ? bvh.primOrder[start] : start);
+            }
+            int mid = (start + end) / 2;
+            int left = adoptLeaf(bvh, start, mid);
+            return join(left, adoptLeaf(bvh, mid, end));
+        }
+
+        //the node a new leaf with box mi -> ma should become the sibling of. Placing it beside a node grows that node's box and
+        //every box above it; the search opens nodes cheapest first, and stops once nothing left open could beat the best so far
+        int findSibling (const vector3& mi, const vector3& ma) const {
+            double leafArea = boxSurfaceArea(mi, ma);
+            int best = root;
+            double bestCost = boxSurfaceArea(vectMin(mi, nodes[root].minimums), vectMax(ma, nodes[root].maximums));
+
+            //(growth of the boxes above a node, node); the growth is all a node's subtree is sure to cost
+            typedef std::pair<double, int> Candidate;
+            std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> open;
+            open.push({0.0, root});
+            while (!open.empty()) {
+                Candidate candidate = open.top();
+                open.pop();
+                double inherited = candidate.first;
+                if (inherited + leafArea >= bestCost) { break; }
+
+                const DynamicBVHNode& node = nodes[candidate.second];
+                double merged = boxSurfaceArea(vectMin(mi, node.minimums), vectMax(ma, node.maximums));
+                if (merged + inherited < bestCost) {
+                    bestCost = merged + inherited;
+                    best = candidate.second;
+                }
+                if (node.isLeaf()) { continue; }
+
+                double childInherited = inherited + merged - boxSurfaceArea(node.minimums, node.maximums);
+                if (childInherited + leafArea < bestCost) {
+                    open.push({childInherited, node.children[0]});
+                    open.push({childInherited, node.children[1]});
+                }
+            }
+            return best;
+        }
+
+        void insertLeaf (int leaf) {
+            if (root < 0) {
+                root = leaf;
+                nodes[leaf].parent = -1;
+                return;
+            }
+
+            int sibling = findSibling(nodes[leaf].minimums, nodes[leaf].maximums);
+            int oldParent = nodes[sibling].parent;
+            int parent = allocate();
+            replaceChild(oldParent, sibling, parent);
+            nodes[parent].children[0] = sibling;
+            nodes[parent].children[1] = leaf;
+            nodes[sibling].parent = parent;
+            nodes[leaf].parent = parent;
+            refitUpwards(parent);
+        }
+
+        void removeLeaf (int leaf) {
+            int parent = nodes[leaf].parent;
+            nodes[leaf].parent = -1;
+            if (parent < 0) {
+                root = -1;
+                return;
+            }
+
+            int sibling = (nodes[parent].children[0] == leaf) ? nodes[parent].children[1] : nodes[parent].children[0];
+            int grandparent = nodes[parent].parent;
+            replaceChild(grandparent, parent, sibling);
+            release(parent);
+            if (grandparent >= 0) { refitUpwards(grandparent); }
+        }
+
+        void refitUpwards (int index) {
+            for (; index >= 0; index = nodes[index].parent) {
+                fitToChildren(index);
+                rotate(index);
+            }
+        }
+
+        //swaps one child of node index with a child of its other child, if that shrinks the box the swap changes. The node's
+        //own box covers the same shapes either way, so nothing above it is affected
+        void rotate (int index) {
+            double bestGain = 0;
+            int bestSide = -1;
+            int bestGrandchild = -1;
+            for (int side = 0; side < 2; side++) {
+                int opened = nodes[index].children[side];   //the child whose children are candidates to swap out
+                int other = nodes[index].children[1 - side]; //the child that would be swapped in
+                if (nodes[opened].isLeaf()) { continue; }
+
+                double openedArea = area(opened);
+                for (int g = 0; g < 2; g++) {
+                    double gain = openedArea - unionArea(other, nodes[opened].children[1 - g]);
+                    if (gain > bestGain) {
+                        bestGain = gain;
+                        bestSide = side;
+                        bestGrandchild = g;
+                    }
+                }
+            }
+            if (bestSide < 0) { return; }
+
+            int opened = nodes[index].children[bestSide];
+            int other = nodes[index].children[1 - bestSide];
+            int grandchild = nodes[opened].children[bestGrandchild];
+            nodes[index].children[1 - bestSide] = grandchild;
+            nodes[grandchild].parent = index;
+            nodes[opened].children[bestGrandchild] = other;
+            nodes[other].parent = opened;
+            fitToChildren(opened);
+            rotations++;
+        }
+
+        //bottom up: how many shapes each subtree holds, and which subtrees are cheaper as one leaf; returns the subtree's SAH
+        //cost relative to its own box, as the builders measure it
+        double planLeaves (int index, int maxLeafSize, std::vector<int>& shapeCount, std::vector<char>& asLeaf) const {
+            const DynamicBVHNode& node = nodes[index];
+            if (node.isLeaf()) {
+                shapeCount[index] = 1;
+                asLeaf[index] = 1;
+                return SAH_INTERSECTION_COST;
+            }
+
+            double nodeArea = area(index);
+            double splitCost = SAH_TRAVERSAL_COST;
+            shapeCount[index] = 0;
+            for (int c = 0; c < 2; c++) {
+                int child = node.children[c];
+                double childCost = planLeaves(child, maxLeafSize, shapeCount, asLeaf);
+                splitCost += (nodeArea > 0 ? area(child) / nodeArea : 1) * childCost;
+                shapeCount[index] += shapeCount[child];
+            }
+
+            double leafCost = SAH_INTERSECTION_COST * shapeCount[index];
+            if (shapeCount[index] <= std::min(maxLeafSize, BVH_LEAF_SIZE_LIMIT) && leafCost <= splitCost) {
+                asLeaf[index] = 1;
+                return leafCost;
+            }
+            return splitCost;
+        }
+
+        void appendShapes (LinearBVH& bvh, int index) const {
+            const DynamicBVHNode& node = nodes[index];
+            if (node.isLeaf()) {
+                bvh.prims.push_back(node.shape);
+                bvh.primOrder.push_back(node.order);
+                return;
+            }
+            appendShapes(bvh, node.children[0]);
+            appendShapes(bvh, node.children[1]);
+        }
+
+        //depth first, left child straight after its parent, as LinearBVH lays its nodes out
+        int emit (LinearBVH& bvh, int index, int depth, const std::vector<char>& asLeaf) const {
+            const DynamicBVHNode& node = nodes[index];
+            int out = bvh.nodes.size();
+            bvh.maxDepth = std::max(bvh.maxDepth, depth);
+            bvh.nodes.push_back(LinearBVHNode());
+
+            LinearBVHNode linear;
+            LinearBVH::setBounds(linear, node.minimums, node.maximums);
+            if (asLeaf[index]) {
+                linear.offset = bvh.prims.size();
+                appendShapes(bvh, index);
+                linear.primCount = bvh.prims.size() - linear.offset;
+                linear.axis = 0;
+            }
+            else {
+                //split axis: the one the children's centres are furthest apart along, which picks the nearer child for rays
+                const DynamicBVHNode& left = nodes[node.children[0]];
+                const DynamicBVHNode& right = nodes[node.children[1]];
+                vector3 apart = (right.minimums + right.maximums) - (left.minimums + left.maximums);
+                linear.axis = 0;
+                for (int a = 1; a < 3; a++) {
+                    if (std::fabs(apart.atr[a]) > std::fabs(apart.atr[linear.axis])) { linear.axis = a; }
+                }
+                //traversal takes the left child as the low side of axis; inserts and rotations don't keep the children in that order
+                int low = node.children[0], high = node.children[1];
+                if (apart.atr[linear.axis] < 0) { std::swap(low, high); }
+                linear.primCount = 0;
+                emit(bvh, low, depth + 1, asLeaf);
+                linear.offset = emit(bvh, high, depth + 1, asLeaf);
+            }
+
+            bvh.nodes[out] = linear; //can't hold a reference over the recursion; the vector may have moved
+            return out;
+        }
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <vector>
+#include <list>
+#include <string>
+#include "vector_helper.h"
+#include "matricies.h"
+#include "lightsource.h"
+#include "shape.h"
+#include "acceleration hierarchy.h"
+
+/*
+==================================================================================================
+Instancing!
+A Mesh is a group of shapes with its own (bottom level) BVH, built once in its own object space.
+An Instance is a shape that drops a mesh into the scene with a transform. Any number of instances can share a mesh,
+so the scene's BVH (the top level) only has to be built over the instances rather than every copy of every shape.
+
+Rays are moved into object space rather than moving the geometry into world space. Their directions are left
+unnormalised, so distances along a ray come out the same in both spaces.
+==================================================================================================
+*/
+
+class Mesh {
+    public:
+        std::vector<Shape*> shapes;
+        LinearBVH* bvh;
+        vector3 minimums;
+        vector3 maximums;
+
+        Mesh (const std::vector<Shape*>& s, const BVHBuildSettings& settings) : shapes(s), bvh(nullptr) {
+            if (shapes.empty()) { return; }
+            std::vector<int> primIndices;
+            BVHNode* root = buildAccelerationHierarchy(shapes, primIndices, settings);
+            bvh = new LinearBVH(root, shapes, primIndices);
+            deleteBVH(root);
+
+            const LinearBVHNode& rootNode = bvh->nodes[0];
+            minimums = {rootNode.minimums[0], rootNode.minimums[1], rootNode.minimums[2]};
+            maximums = {rootNode.maximums[0], rootNode.maximums[1], rootNode.maximums[2]};
+        }
+};
+
+class Instance : public Shape {
+    private:
+        Mesh* mesh;
+        matrix4 objectToWorld;
+        matrix4 worldToObject;
+        matrix4 normalToWorld; //normals go back with the inverse transpose, so they stay perpendicular under non-uniform scales
+        vector3 minimums;
+        vector3 maximums;
+
+        //the direction isn't renormalised, so distances along the ray (& its interval) mean the same in both spaces
+        Ray toObject (Ray& ray) {
+            Ray objectRay = Ray(transformPoint(worldToObject, ray.getOrigin()), transformDirection(worldToObject, ray.getDirection()));
+            objectRay.setInterval(ray.getTMin(), ray.getTMax());
+            return objectRay;
+        }
+
+    public:
+        Instance (Mesh* m, matrix4 transform, int id) : Shape(Material(), id), mesh(m), objectToWorld(transform) {
+            worldToObject = mat4AffineInverse(objectToWorld);
+            normalToWorld = mat4Transpose(worldToObject);
+
+            //the world space box is the box around all eight corners of the mesh's box
+            minimums = {INFINITY, INFINITY, INFINITY};
+            maximums = {-INFINITY, -INFINITY, -INFINITY};
+            for (int corner = 0; corner < 8; corner++) {
+                vector3 p = {(corner & 1) ? mesh->maximums.x() : mesh->minimums.x(),
+                             (corner & 2) ? mesh->maximums.y() : mesh->minimums.y(),
+                             (corner & 4) ? mesh->maximums.z() : mesh->minimums.z()};
+                p = transformPoint(objectToWorld, p);
+                minimums = vectMin(minimums, p);
+                maximums = vectMax(maximums, p);
+            }
+        }
+
+        std::string getType () override { return "instance"; }
+        vector3 getMinimums () override { return minimums; }
+        vector3 getMaximums () override { return maximums; }
+        vector3 getCenter () override { return (minimums + maximums) * 0.5; }
+
+        double hitDistance (Ray& ray) override {
+            Ray objectRay = toObject(ray);
+            int checks = 0;
+            if (!findClosest(mesh->bvh, objectRay, checks)) { return -1; }
+            return objectRay.getTMax();
+        }
+
+        //shapes in the instance being shaded can still shadow each other; only the shaded shape itself is skipped
+        bool occludes (Ray& ray, int ignoreID, int ignoreInstanceID = -1) override {
+            Ray objectRay = toObject(ray);
+            return findOccluder(mesh->bvh, objectRay, (id == ignoreInstanceID) ? ignoreID : -1) != nullptr;
+        }
+
+        //the winning shape's hit comes back unshaded, and is moved out to world space (the normal by the inverse transpose) before
+        //that shape shades it; lighting in object space would skew N.L & the highlights under non-uniform scales and shears
+        Hit intersect (Ray& ray, const std::list<LightSource*>& l, vector3 camLook, bool calcMaterial = true) override {
+            Shape* shader = nullptr;
+            Hit hit = intersectUnshaded(ray, shader);
+            if (calcMaterial && hit.getT() >= 0) { shader->shade(hit, l, camLook); }
+            return hit;
+        }
+
+    private:
+        //the closest hit in world space, and the shape that should shade it; that's inside the innermost instance, for instances
+        //of meshes that hold instances themselves
+        Hit intersectUnshaded (Ray& ray, Shape*& shader) {
+            Ray objectRay = toObject(ray);
+            int checks = 0;
+            Shape* closest = findClosest(mesh->bvh, objectRay, checks);
+            if (!closest) { return Hit(); }
+
+            Hit hit;
+            if (closest->getType() == "instance") { hit = static_cast<Instance*>(closest)->intersectUnshaded(objectRay, shader); }
+            else {
+                hit = closest->intersect(objectRay, {}, {0,0,0}, false);
+                shader = closest;
+            }
+            if (hit.getT() < 0) { return hit; }
+
+            hit.setPoint(ray.at(hit.getT()));
+            hit.setNormal(vectNormalize(transformDirection(normalToWorld, hit.getNormal())));
+            hit.setInstanceID(id);
+            return hit;
+        }
+};
+
+#endif
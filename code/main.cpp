@@ -4,6 +4,8 @@
 #include <vector>
 #include <list>
 #include <array>
+#include <map>
+#include <memory>
 #include <filesystem>
 #include "nlohmann/json.hpp"
 #include "raytracer.h"
@@ -15,6 +17,13 @@
 #include "vector_helper.h"
 #include "image.h"
 #include "acceleration hierarchy.h"
+#include "matricies.h"
+#include "instance.h"
+#include "bvh_cache.h"
+#include "bvh_report.h"
+#include "bvh_compressed.h"
+#include "uniform_grid.h"
+#include "triangle_mesh.h"
 
 using json = nlohmann::json;
 
@@ -92,13 +101,92 @@ Image readPPM(const std::string& filename, bool print = true) {
     return img;
 }
 
+//Reads an instance's transform; either a full row-major "transform" matrix (16 numbers), or any of "scale" (a number or a vector),
+//"rotate" (degrees about x, y, then z) and "translate", which are applied in that order
+matrix4 readTransform (json& data) {
+    if (!data["transform"].is_null()) {
+        std::vector<double> m = data["transform"];
+        if (m.size() == 16) {
+            return matrix4(vector4(m[0], m[1], m[2], m[3]), vector4(m[4], m[5], m[6], m[7]),
+                           vector4(m[8], m[9], m[10], m[11]), vector4(m[12], m[13], m[14], m[15]));
+        }
+        std::cerr << "Instance transforms need 16 values; ignoring it." << std::endl;
+    }
+
+    vector3 scale = {1,1,1};
+    vector3 rotate = {0,0,0};
+    vector3 translate = {0,0,0};
+    if (data["scale"].is_number()) { double d = data["scale"]; scale = {d,d,d}; }
+    else if (!data["scale"].is_null()) { std::vector<double> v = data["scale"]; scale = vector3(v); }
+    if (!data["rotate"].is_null()) { std::vector<double> v = data["rotate"]; rotate = vector3(v); }
+    if (!data["translate"].is_null()) { std::vector<double> v = data["translate"]; translate = vector3(v); }
+    return mat4Translate(translate) * mat4Rotate(rotate) * mat4Scale(scale);
+}
+
+//Creates the shape described by one entry of a "shapes" list; instances look their mesh up by name in meshes, and triangles
+//put their intersection data in triangles. "trianglemesh" shapes load the .obj file at "file" (see triangle_mesh.h), moved by the
+//same "transform" / "scale" / "rotate" / "translate" an instance takes. Returns nullptr if the shape can't be made.
+Shape* loadShape (json& data, int objID, const std::map<std::string, Mesh*>& meshes, TriangleTable* triangles, bool print = true) {
+    if (print) {std::cout << "Loading " << data["type"] << " [id: " << objID << "] ..." << std::endl;}
+
+    if (data["type"] == "instance") {
+        auto mesh = meshes.find(data["mesh"]);
+        if (mesh == meshes.end() || !mesh->second->bvh) {
+            std::cerr << "Instance of unknown (or empty) mesh " << data["mesh"] << "; skipping it." << std::endl;
+            return nullptr;
+        }
+        matrix4 transform = readTransform(data);
+        if (mat4AffineDeterminant(transform) == 0) {
+            std::cerr << "Instance of mesh " << data["mesh"] << " has a flat transform; skipping it." << std::endl;
+            return nullptr;
+        }
+        return new Instance(mesh->second, transform, objID);
+    }
+
+    json md = data["material"];
+    Material mat;
+    if (!md.is_null()) {
+        std::vector<double> difc = md["diffusecolor"];
+        std::vector<double> spec = md["specularcolor"];
+        bool hasTexture = false;
+        Image texture;
+        json jsonTex = md["diffusetexture"];
+        if (!jsonTex.is_null()) {
+            hasTexture = true;
+            if (jsonTex == "null") { hasTexture = false; }
+            else {
+                texture = readPPM(jsonTex, print);
+            }
+        }
+        mat = Material(md["ks"], md["kd"], md["specularexponent"], vector3(difc), hasTexture, texture, vector3(spec), md["isreflective"], md["reflectivity"], md["isrefractive"], md["refractiveindex"]);
+    } else { std::cout << "Material not found!" << std::endl; }
+
+    if (data["type"] == "trianglemesh") {
+        return readOBJ(data["file"], mat, objID, readTransform(data), print);
+    } else if (data["type"] == "triangle") {
+        std::vector<double> v0 = data["v0"];
+        std::vector<double> v1 = data["v1"];
+        std::vector<double> v2 = data["v2"];
+        return new Triangle(vector3(v0), vector3(v1), vector3(v2), mat, objID, triangles);
+    } else if (data["type"] == "cylinder") {
+        std::vector<double> c = data["center"];
+        std::vector<double> a = data["axis"];
+        return new Cylinder(vector3(c), vector3(a), data["radius"], data["height"], mat, objID);
+    }
+    std::vector<double> c = data["center"];
+    return new Sphere(vector3(c), data["radius"], mat, objID);
+}
+
 //Reads JSON file with name 'filename' and initialises a complete scene & camera, which are entered into a new RayTracer instance and returned.
-RayTracer loadScene (std::string& filename, bool print = true) {
+//previousBVH is the last frame's hierarchy when rendering a sequence; if the shapes line up with it, it gets refitted instead of rebuilt.
+//The loader takes ownership of previousBVH: it's either reused by the new scene or freed, so the last frame mustn't render with it again.
+RayTracer loadScene (std::string& filename, bool print = true, LinearBVH* previousBVH = nullptr) {
     
     //read JSON
     std::ifstream file(filename);
     if (!file.is_open()) {
         std::cerr << "Error opening the JSON file." << std::endl;
+        delete previousBVH;
         return RayTracer();
     }
     json jsonData;
@@ -119,58 +207,189 @@ RayTracer loadScene (std::string& filename, bool print = true) {
         cam = ThinLens(camData["width"], camData["height"], pos, look, up, camData["fov"], camData["exposure"]);
     }
 
-    //create shapes
-    std::vector<Shape*> shapes;
+    //Assemble acceleration hierarchy; the builder can be picked with "acceleration" : { "builder" : "median" / "sah" / "lbvh" / "sbvh" },
+    //the number of shapes a leaf may hold with "maxLeafSize", and a 4-wide tree with "width" : 4
+    //"sbvh" cuts long thin shapes between leaves; "splitBudget" caps the extra references that adds, as a fraction of the shape count
+    //"restructure" : <seconds> spends up to that long improving the built tree's treelets (worth it for long, final renders)
+    //For sequences, "refit" (default true) reuses the last frame's tree when the shapes are the same, until its SAH cost has grown
+    //by more than "refitThreshold" times what it was when it was built
+    //"cache" : true writes the built tree next to the scene file (as <scene>.bvhcache), and reuses it while the geometry is unchanged
+    //"compress" : 8 / 16 renders with a copy of the binary tree whose boxes are quantized to that many bits (see bvh_compressed.h)
+    //"structure" : "bvh" / "grid" / "auto" (default) picks the accelerator; "auto" uses a uniform grid for big scenes of similar
+    //sized shapes (see uniform_grid.h), and none of the BVH settings apply to a grid
+    //"report" : "<file>" saves a JSON summary of the tree's quality (see bvh_report.h); it's also printed when printing is on
+    BVHBuildSettings buildSettings;
+    int width = 2;
+    int compress = 0;
+    std::string structure = "auto";
+    bool refit = true;
+    double refitThreshold = BVH_REFIT_THRESHOLD;
+    bool cache = false;
+    std::string reportPath;
+    json accelData = jsonData["acceleration"];
+    if (!accelData.is_null() && !accelData["builder"].is_null()) { buildSettings.builder = accelData["builder"]; }
+    if (!accelData.is_null() && !accelData["maxLeafSize"].is_null()) { buildSettings.maxLeafSize = accelData["maxLeafSize"]; }
+    if (!accelData.is_null() && !accelData["splitBudget"].is_null()) { buildSettings.splitBudget = accelData["splitBudget"]; }
+    if (!accelData.is_null() && !accelData["restructure"].is_null()) { buildSettings.restructureSeconds = accelData["restructure"]; }
+    if (!accelData.is_null() && !accelData["width"].is_null()) { width = accelData["width"]; }
+    if (!accelData.is_null() && !accelData["compress"].is_null()) { compress = accelData["compress"]; }
+    if (!accelData.is_null() && !accelData["structure"].is_null()) { structure = accelData["structure"]; }
+    if (!accelData.is_null() && !accelData["refit"].is_null()) { refit = accelData["refit"]; }
+    if (!accelData.is_null() && !accelData["refitThreshold"].is_null()) { refitThreshold = accelData["refitThreshold"]; }
+    if (!accelData.is_null() && !accelData["cache"].is_null()) { cache = accelData["cache"]; }
+    if (!accelData.is_null() && !accelData["report"].is_null()) { reportPath = accelData["report"]; }
+
+    //create meshes; groups of shapes that can be placed around the scene any number of times by "instance" shapes
+    std::map<std::string, Mesh*> meshes;
+    //shared by every triangle in the scene, meshes included; the scene keeps it, as its triangles read from it for as long as they're rendered
+    std::shared_ptr<TriangleTable> triangles = std::make_shared<TriangleTable>();
     int objID = 1;
     json sceneData = jsonData["scene"];
+    json meshData = sceneData["meshes"];
+    if (!meshData.is_null()) {
+        for (const auto& item : meshData.items()) {
+            if (print) { std::cout << "Loading mesh " << item.key() << " ..." << std::endl; }
+            std::vector<Shape*> meshShapes;
+            for (const auto& shapeItem : item.value()["shapes"].items()) {
+                Shape* newShape = loadShape(shapeItem.value(), objID, meshes, triangles.get(), print);
+                if (newShape) { meshShapes.push_back(newShape); }
+                objID += newShape ? newShape->idCount() : 1;
+            }
+            meshes[item.key()] = new Mesh(meshShapes, buildSettings);
+        }
+        if (print) { std::cout << "Loaded " << meshes.size() << " meshes.\n" << std::endl; }
+    }
+
+    //create shapes
+    std::vector<Shape*> shapes;
     json shapeData = sceneData["shapes"];
     for (const auto& item : shapeData.items() ) {
-        if (print) {std::cout << "Loading " << item.value()["type"] << " [id: " << objID << "] ..." << std::endl;}
-        
-        json md = item.value()["material"];
-        Material mat;
-        if (!md.is_null()) {
-            std::vector<double> difc = md["diffusecolor"];
-            std::vector<double> spec = md["specularcolor"];
-            bool hasTexture = false;
-            Image texture;
-            json jsonTex = md["diffusetexture"];
-            if (!jsonTex.is_null()) {
-                hasTexture = true;
-                if (jsonTex == "null") { hasTexture = false; }
-                else {
-                    texture = readPPM(jsonTex, print);
-                }
+        Shape* newShape = loadShape(item.value(), objID, meshes, triangles.get(), print);
+        if (newShape) { shapes.push_back(newShape); }
+        objID += newShape ? newShape->idCount() : 1;
+    }
+    if (print) { std::cout << "Loaded " << shapes.size() << " shapes.\n" << std::endl; }
+    if (print && triangles->size() > 0) {
+        std::cout << "Triangle table : " << triangles->size() << " triangles, " << triangles->memoryBytes() / 1024.0 << " KB\n" << std::endl;
+    }
+
+    UniformGrid* grid = nullptr;
+    double sizeVariation = 0;
+    bool gridSuits = gridSuitsScene(shapes, sizeVariation);
+    if (structure == "grid" || (structure == "auto" && gridSuits)) {
+        auto gridStart = std::chrono::steady_clock::now();
+        grid = new UniformGrid(shapes);
+        if (print) {
+            std::cout << "Uniform grid (" << (structure == "grid" ? "asked for" : "auto") << ", shape size variation " << sizeVariation
+                      << ") : " << grid->resolution[0] << " x " << grid->resolution[1] << " x " << grid->resolution[2] << " cells, "
+                      << grid->cellPrims.size() << " references, " << grid->memoryBytes() / 1024.0 << " KB, built in "
+                      << nanosecondsSince(gridStart) * 1e-9 << "s\n" << std::endl;
+        }
+        if (structure == "auto" && !gridWorthKeeping(grid, shapes.size())) {
+            if (print) { std::cout << "Shapes span too many grid cells each; using a BVH instead.\n" << std::endl; }
+            delete grid;
+            grid = nullptr;
+        }
+    }
+    else if (structure != "bvh" && structure != "auto") { std::cout << "Unknown acceleration structure '" << structure << "'; using a BVH." << std::endl; }
+
+    LinearBVH* bvh = nullptr;
+    if (!grid && refit && previousBVH && previousBVH->sameTopology(shapes)) {
+        previousBVH->refit(shapes);
+        double cost = linearBVHSAHCost(previousBVH);
+        if (cost <= previousBVH->builtCost * refitThreshold) {
+            bvh = previousBVH;
+            if (print) { std::cout << "Refitted last frame's BVH | SAH cost : " << cost << " (built at " << bvh->builtCost << ")\n" << std::endl; }
+        }
+        else if (print) { std::cout << "Refitted BVH has degraded too far (SAH cost " << cost << "); rebuilding.\n" << std::endl; }
+    }
+    if (previousBVH && bvh != previousBVH) { delete previousBVH; } //refitted in place, or never fit this frame; either way it's done with
+
+    uint64_t geometryHash = 0;
+    std::string cachePath = filename + ".bvhcache";
+    if (!grid && !bvh && cache) {
+        auto cacheStart = std::chrono::steady_clock::now();
+        geometryHash = hashSceneGeometry(shapes, buildSettings);
+        bvh = loadBVHCache(cachePath, geometryHash, shapes);
+        if (bvh && print) {
+            std::cout << "Loaded BVH from " << cachePath << " in " << nanosecondsSince(cacheStart) * 1e-9 << "s : "
+                      << bvh->nodes.size() << " nodes\n" << std::endl;
+        }
+    }
+
+    if (!grid && !bvh) {
+        std::vector<int> primIndices;
+        BVHNode* root = buildAccelerationHierarchy(shapes, primIndices, buildSettings, print);
+
+        //flatten the tree into a compact array for traversal; the pointer tree isn't needed after this
+        bvh = new LinearBVH(root, shapes, primIndices);
+        bvh->builtCost = linearBVHSAHCost(bvh);
+        if (print) {
+            std::cout << "Flattened BVH : " << bvh->nodes.size() << " nodes, " << bvh->nodes.size() * sizeof(LinearBVHNode) / 1024.0
+                      << " KB (pointer tree : " << bvh->nodes.size() * sizeof(BVHNode) / 1024.0 << " KB)\n" << std::endl;
+        }
+        deleteBVH(root);
+
+        if (cache) {
+            if (writeBVHCache(cachePath, geometryHash, bvh)) {
+                if (print) { std::cout << "Wrote BVH cache to " << cachePath << "\n" << std::endl; }
             }
-            mat = Material(md["ks"], md["kd"], md["specularexponent"], vector3(difc), hasTexture, texture, vector3(spec), md["isreflective"], md["reflectivity"], md["isrefractive"], md["refractiveindex"]);
-        } else { std::cout << "Material not found!" << std::endl; }
-
-        if (item.value()["type"] == "triangle") {
-            std::vector<double> v0 = item.value()["v0"];
-            std::vector<double> v1 = item.value()["v1"];
-            std::vector<double> v2 = item.value()["v2"];
-            Shape* newShape = new Triangle(vector3(v0), vector3(v1), vector3(v2), mat, objID);
-            shapes.push_back(newShape);
-        } else if (item.value()["type"] == "cylinder") {
-            std::vector<double> c = item.value()["center"];
-            std::vector<double> a = item.value()["axis"];
-            Shape* newShape = new Cylinder(vector3(c), vector3(a), item.value()["radius"], item.value()["height"], mat, objID);
-            shapes.push_back(newShape);
-        } else {
-            std::vector<double> c = item.value()["center"];
-            Shape* newShape = new Sphere(vector3(c), item.value()["radius"], mat, objID);
-            shapes.push_back(newShape);
+            else { std::cerr << "Couldn't write BVH cache to " << cachePath << std::endl; }
         }
-        objID++;
     }
-    if (print) { std::cout << "Loaded " << shapes.size() << " shapes.\n" << std::endl; }
 
-    //Assemble acceleration hierarchy
-    BVHNode* root = buildBVH(cam.getPosition(), shapes, 0, shapes.size() - 1);
-    if (print) {
-        std::cout << "\n=== ACCELERATION HIERARCHY ===\n" << std::endl;
-        printBVH(root, "* "); //display heirarchy! 
-        std::cout << "\n======== HIERARCHY END =======\n" << std::endl;
+    LinearBVH4* wideBVH = nullptr;
+    if (bvh && width == 4) {
+        wideBVH = new LinearBVH4(*bvh);
+        if (print) { std::cout << "4-wide BVH : " << wideBVH->nodes.size() << " nodes, " << wideBVH->nodes.size() * sizeof(BVH4Node) / 1024.0 << " KB\n" << std::endl; }
+    }
+    else if (width != 2 && width != 4) { std::cout << "BVH width " << width << " isn't supported; using a binary tree." << std::endl; }
+
+    CompressedBVH* compressedBVH = nullptr;
+    if (compress != 0 && wideBVH) { std::cout << "Compressed nodes only come in the binary layout; using the 4-wide tree uncompressed." << std::endl; }
+    else if (bvh && compress != 0) {
+        if (compress != 8 && compress != 16) { std::cout << "Can't compress BVH nodes to " << compress << " bits; using 16." << std::endl; }
+        compressedBVH = new CompressedBVH(*bvh, compress);
+        if (print) {
+            std::cout << "Compressed BVH (" << compressedBVH->bits << " bit) : " << compressedBVH->nodeCount() << " nodes, "
+                      << compressedBVH->memoryBytes() / 1024.0 << " KB (binary : "
+                      << (bvh->nodes.size() * sizeof(LinearBVHNode) + bvh->prims.size() * sizeof(Shape*)) / 1024.0 << " KB)\n" << std::endl;
+        }
+    }
+
+    //lay the triangle table out in the order the meshes' and scene's leaves (or grid cells) reach the triangles
+    if (triangles->size() > 0) {
+        std::vector<int> triangleOrder;
+        triangleOrder.reserve(triangles->size());
+        for (const auto& [name, mesh] : meshes) {
+            if (mesh->bvh) { appendTriangleSlots(mesh->bvh->prims, triangles.get(), triangleOrder); }
+        }
+        if (bvh) { appendTriangleSlots(bvh->prims, triangles.get(), triangleOrder); }
+        if (grid) { appendTriangleSlots(grid->cellPrims, triangles.get(), triangleOrder); }
+        triangles->reorder(triangleOrder);
+    }
+
+    //quality report for the tree we're about to render with; printed alongside everything else, and saved if a path is given
+    if (print || !reportPath.empty()) {
+        json report = bvhReport(bvh, wideBVH, compressedBVH);
+        report["scene"] = filename;
+        report["builder"] = buildSettings.builder;
+        report["maxLeafSize"] = buildSettings.maxLeafSize;
+        report["width"] = wideBVH ? 4 : 2;
+        report["compress"] = compressedBVH ? compressedBVH->bits : 0;
+        report["structure"] = grid ? "grid" : "bvh";
+        if (grid) {
+            report["grid"] = {{"resolution", {grid->resolution[0], grid->resolution[1], grid->resolution[2]}}, {"cells", grid->cellCount()},
+                              {"references", grid->cellPrims.size()}, {"sizeVariation", sizeVariation}, {"memoryBytes", grid->memoryBytes()}};
+        }
+        if (print) {
+            std::cout << "\n=== ACCELERATION HIERARCHY ===\n" << report.dump(4) << "\n======== HIERARCHY END =======\n" << std::endl;
+        }
+        if (!reportPath.empty()) {
+            std::ofstream reportFile(reportPath);
+            if (reportFile) { reportFile << report.dump(4) << std::endl; }
+            else { std::cerr << "Couldn't write BVH report to " << reportPath << std::endl; }
+        }
     }
 
     //create lights
@@ -200,7 +419,7 @@ RayTracer loadScene (std::string& filename, bool print = true) {
 
     //create scene, create & return raytracer
     std::vector<double> bgcol = sceneData["backgroundcolor"];
-    Scene scene = Scene(vector3(bgcol), lights, root);
+    Scene scene = Scene(vector3(bgcol), lights, bvh, wideBVH, compressedBVH, grid, buildSettings, triangles);
     if (print) { std::cout << "Scene Loaded!" << std::endl; }
 
     std::list<Ray> rays;
@@ -209,6 +428,8 @@ RayTracer loadScene (std::string& filename, bool print = true) {
     if (!jsonData["nbounces"].is_null()) { bounces = jsonData["nbounces"]; }
 
     RayTracer r = RayTracer(cam, scene, rays, hits, bounces, jsonData["rendermode"], objID);
+    //"renderdistance" : <distance> is a far plane for camera & bounced rays; anything past it is background. Unlimited by default
+    if (!jsonData["renderdistance"].is_null()) { r.renderDistance = jsonData["renderdistance"]; }
     std::cout << "Ray Tracer Loaded!" << std::endl;
 
     return r; 
@@ -262,6 +483,28 @@ std::vector<std::string> getJsonFilePaths(const std::string& folderPath) {
     return jsonFilePaths;
 }
 
+//The top level shape with id objID in the scene, or nullptr; shapes inside meshes & instances can't be picked out on their own
+Shape* findShapeByID (Scene& scene, int objID) {
+    if (scene.getGrid()) {
+        for (Shape* s : scene.getGrid()->cellPrims) { if (s->getID() == objID) { return s; } }
+    }
+    else if (scene.getShapes()) {
+        for (Shape* s : scene.getShapes()->prims) { if (s->getID() == objID) { return s; } }
+    }
+    return nullptr;
+}
+
+//How many pixels differ between two renders of the same size
+int countChangedPixels (Image& before, Image& after) {
+    int changed = 0;
+    for (int y = 0; y < before.getHeight(); y++) {
+        for (int x = 0; x < before.getWidth(); x++) {
+            if (before.getPixel(x, y) != after.getPixel(x, y)) { changed++; }
+        }
+    }
+    return changed;
+}
+
 int main () {
     std::cout << "Welcome to the raytracer!!\n" << std::endl;
 
@@ -300,7 +543,7 @@ int main () {
             //skip frames as desired! helps with not having to re-render stuff innit
             if (i >= start) {
                 std::cout << std::endl;
-                tracer = loadScene(file, toPrint);
+                tracer = loadScene(file, toPrint, tracer.getScene().getShapes()); //frames that only move shapes around get a refit
 
                 Image img = tracer.startThreadedRender(samples,20);
                 std::string offset = ""; //used to order scenes manually -> keeps pics sorted in frame order for my video
@@ -338,6 +581,35 @@ int main () {
         Image img = tracer.startThreadedRender(samples,threads);
         exportPPMImage("render.ppm", img, tracer.getCamera());
 
+        //previews: hide a shape (or bring a hidden one back) through the scene's live edits, and re-render without reloading
+        std::map<int, Shape*> hidden;
+        while (true) {
+            int shapeID = 0;
+            std::cout << "\nHide (or unhide) a shape by id and render a preview? [0: no more previews] : ";
+            if (!(std::cin >> shapeID) || shapeID == 0) { break; }
+
+            Scene& scene = tracer.getScene();
+            auto found = hidden.find(shapeID);
+            if (found != hidden.end()) {
+                scene.insertShape(found->second);
+                hidden.erase(found);
+            }
+            else {
+                Shape* shape = findShapeByID(scene, shapeID);
+                if (!shape) {
+                    std::cout << "The scene has no shape with id " << shapeID << "." << std::endl;
+                    continue;
+                }
+                scene.removeShape(shape);
+                hidden[shapeID] = shape;
+            }
+
+            Image preview = tracer.startThreadedRender(samples, threads);
+            std::cout << countChangedPixels(img, preview) << " pixels changed since the last render." << std::endl;
+            exportPPMImage("render.ppm", preview, tracer.getCamera());
+            img = preview;
+        }
+
         std::cout << "the scene has " << tracer.totalObjs << " total objects btw.";
     }
 
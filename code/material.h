@@ -35,14 +35,14 @@ class Material {
         double getRefIndex () { return refractiveindex; }
         bool exists () { return e; } //check if material was initialised properly
         bool hasTexture () { return useDiffuseTexture; }
-        Image getTexture () { return diffTex; }
+        Image& getTexture () { return diffTex; } //by reference; copying the whole texture on every hit was a lot of allocating
         vector3 getDiffuse () { return diffusecolor; }
         vector3 getSpecular () { return specularcolor; }
 
         //I don't know where else to put this tbh! Bit annoying as now I have to pass lights into the shape intersection thing but w/e
         //Should hopefully return the proper colour now !
         //TODO: set hit diffuse and specular tones seperately -> apply them independently in raytracer maybe?
-        vector3 calculatePhongShading (Hit* hit, vector3 normal, vector3 intersectionPoint, std::list<LightSource*> l, vector3 camLook, vector3 texCoords) {
+        vector3 calculatePhongShading (Hit* hit, vector3 normal, vector3 intersectionPoint, const std::list<LightSource*>& l, vector3 camLook, vector3 texCoords) {
             vector3 intensity = {0,0,0};
 
             if (e) {
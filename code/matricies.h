@@ -13,7 +13,8 @@ Defining matrix4 in terms of vector4s makes it much more managable imo.
 Crucial to keep in mind that vectors correspond to ROWS of the matrix; made implementation slightly easier!
 
 This script was created for persective mapping, which is unimplemented in the renderer.
-Hence, this file is currently deprecated; should possibly be removed entirely?
+It's now used for instancing though! Instances carry an (affine) object -> world transform, and rays are moved
+into object space with its inverse.
 ==============================================================================================================
 */
 
@@ -53,6 +54,19 @@ vector4 operator *(const matrix4 m, const vector4& v) {
     return vector4(x,y,z,w);
 }
 
+//matrix product; transforming by m * n applies n first, then m
+matrix4 operator *(const matrix4& m, const matrix4& n) {
+    matrix4 result;
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) {
+            double sum = 0;
+            for (int k = 0; k < 4; k++) { sum += m.atr[r].atr[k] * n.atr[k].atr[c]; }
+            result.atr[r].atr[c] = sum;
+        }
+    }
+    return result;
+}
+
 /*
 ========================================================================================
 And now for the funny functions we're all here for!
@@ -78,6 +92,85 @@ matrix4 mat4Identity() {
     return matrix4({v1,v2,v3,v4});
 };
 
+// Swap rows and columns
+matrix4 mat4Transpose(const matrix4& m) {
+    matrix4 result;
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) { result.atr[r].atr[c] = m.atr[c].atr[r]; }
+    }
+    return result;
+}
+
+// Affine transforms; combine them with * (e.g. translate * rotate * scale scales first and translates last)
+matrix4 mat4Translate(const vector3& t) {
+    matrix4 m = mat4Identity();
+    for (int i = 0; i < 3; i++) { m.atr[i].atr[3] = t.atr[i]; }
+    return m;
+}
+
+matrix4 mat4Scale(const vector3& s) {
+    matrix4 m = mat4Identity();
+    for (int i = 0; i < 3; i++) { m.atr[i].atr[i] = s.atr[i]; }
+    return m;
+}
+
+// Rotation by the given angles (in degrees) about x, then y, then z
+matrix4 mat4Rotate(const vector3& degrees) {
+    matrix4 axes[3];
+    for (int a = 0; a < 3; a++) {
+        double theta = degrees.atr[a] * (M_PI / 180);
+        int i = (a + 1) % 3; //the two axes spanning the plane of rotation
+        int j = (a + 2) % 3;
+        axes[a] = mat4Identity();
+        axes[a].atr[i].atr[i] = std::cos(theta);
+        axes[a].atr[i].atr[j] = -std::sin(theta);
+        axes[a].atr[j].atr[i] = std::sin(theta);
+        axes[a].atr[j].atr[j] = std::cos(theta);
+    }
+    return axes[2] * axes[1] * axes[0];
+}
+
+// Determinant of the upper 3x3 (the linear part of an affine transform); zero means the transform flattens space
+double mat4AffineDeterminant(const matrix4& m) {
+    const vector4* a = m.atr;
+    return a[0].x() * (a[1].y() * a[2].z() - a[1].z() * a[2].y())
+         - a[0].y() * (a[1].x() * a[2].z() - a[1].z() * a[2].x())
+         + a[0].z() * (a[1].x() * a[2].y() - a[1].y() * a[2].x());
+}
+
+// Inverse of an affine transform (bottom row 0 0 0 1); the 3x3 part is inverted by cofactors, then the translation is undone
+matrix4 mat4AffineInverse(const matrix4& m) {
+    const vector4* a = m.atr;
+    double invDet = 1.0 / mat4AffineDeterminant(m);
+
+    matrix4 result = mat4Identity();
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            //cofactor of element (c, r), which is the same as the transposed adjugate
+            int r1 = (c + 1) % 3, r2 = (c + 2) % 3;
+            int c1 = (r + 1) % 3, c2 = (r + 2) % 3;
+            result.atr[r].atr[c] = (a[r1].atr[c1] * a[r2].atr[c2] - a[r1].atr[c2] * a[r2].atr[c1]) * invDet;
+        }
+    }
+    for (int r = 0; r < 3; r++) {
+        double t = 0;
+        for (int c = 0; c < 3; c++) { t -= result.atr[r].atr[c] * a[c].w(); }
+        result.atr[r].atr[3] = t;
+    }
+    return result;
+}
+
+// Apply a transform to a position (picks up translation) or to a direction (doesn't)
+vector3 transformPoint(const matrix4& m, const vector3& p) {
+    vector4 v = m * vector4(p, 1);
+    return vector3(v.x(), v.y(), v.z());
+}
+
+vector3 transformDirection(const matrix4& m, const vector3& d) {
+    vector4 v = m * vector4(d, 0);
+    return vector3(v.x(), v.y(), v.z());
+}
+
 // Create a perspective projection matrix
 matrix4 createPerspectiveMatrix(float fov, float aspectRatio, float near, float far) {
     double f = 1.0 / std::tan(fov / 2.0);
@@ -101,7 +194,7 @@ vector3 projectPointToImage (const vector3& point3D, const matrix4& viewProjecti
     int x = (pointInClipSpace.x() + 1.0f) * 0.5f * screenWidth;
     int y = (1.0f - pointInClipSpace.y()) * 0.5f * screenHeight;
 
-    return vector3{x,y,0};
+    return vector3{(double) x, (double) y, 0};
 }
 
 #endif
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <vector>
 #include <string>
 #include <list>
+#include <cmath>
+#include <utility>
 #include "shape.h"
 #include "material.h"
 #include "vector_helper.h"
@@ -18,7 +20,9 @@ class Hit {
         vector3 hitPoint;
         vector3 hitNormal;
         vector3 colour;
+        vector3 texCoords; //where on its shape's texture the hit is; kept so the hit can be shaded after it's been found
         int hitShapeId;  //the id of the shape that created this Hit object
+        int instanceId;  //the id of the instance the shape was hit through; -1 if it wasn't part of one
         double bounceMult;
         double refIndex;
         bool bounce;
@@ -27,9 +31,9 @@ class Hit {
         int checks; //debugging acceleration only 
 
     public:
-        Hit () { t = -1; checks = 0; hitShapeId = -1; }
+        Hit () { t = -1; checks = 0; hitShapeId = -1; instanceId = -1; }
         Hit (double ti, vector3 hit, vector3 norm, vector3 col, int id, double cm, double ri) : t(ti), hitPoint(hit), hitNormal(norm), colour(col), 
-                                                                                hitShapeId(id), bounceMult(cm), refIndex(ri), bounce(false), refract(false),
+                                                                                hitShapeId(id), instanceId(-1), bounceMult(cm), refIndex(ri), bounce(false), refract(false),
                                                                                 boundingBox(false), checks(0) {}
         ~Hit () { }
 
@@ -37,7 +41,9 @@ class Hit {
         vector3 getPoint () const { return hitPoint; }
         vector3 getNormal () const { return hitNormal; }
         vector3 getColour () const { return colour; }
+        vector3 getTexCoords () const { return texCoords; }
         int getHitID () const { return hitShapeId; }
+        int getInstanceID () const { return instanceId; }
         double getReflectivity () const { return bounceMult; }
         double getRefractiveIndex() const { return refIndex; }
         bool getBounce () const { return bounce; }
@@ -46,29 +52,70 @@ class Hit {
         int getChecks () const { return checks; }
 
         void setColour (vector3 c) { colour = c; }
+        void setTexCoords (vector3 c) { texCoords = c; }
+        void setPoint (vector3 p) { hitPoint = p; }   //instances move hits from object space back into world space with these
+        void setNormal (vector3 n) { hitNormal = n; }
         void setBounce (bool b) { bounce = b; }
         void setRefract (bool b) { refract = b; }
         void setBounding (bool b) { boundingBox = b; }
         void setChecks (int i) { checks = i; }
         void setID (int i) { hitShapeId = i; } //should not be used normally; good for debugging certain interactions tho!
+        void setInstanceID (int i) { instanceId = i; }
 };
 
+//how far along a secondary (shadow) ray hits start counting; keeps rays from hitting the surface they leave from
+const double RAY_EPSILON = 1e-4;
+
 /* a ray that is (typically) cast from a camera to detect objects in the scene.
- stores a reference to the most recently intersected object as lastHit. */
+ stores a reference to the most recently intersected object as lastHit.
+ the reciprocal direction & its signs are worked out once here, since every box test needs them; and only hits between
+ tMin & tMax count. Closest-hit traversals pull tMax in to the nearest hit so far, which culls every box beyond it.
+ the shear is the watertight triangle test's per-ray setup (see triangle_table.h): it turns the ray into the +z axis */
 class Ray {
     private:
         vector3 origin;
         vector3 direction;
+        vector3 invDirection;
+        int sign[3]; //1 where the reciprocal direction is negative (-0 included, as its reciprocal is -inf)
+        int shearAxis[3]; //the axes that become x, y & z; z is the direction's largest
+        double shear[3];
+        double tMin;
+        double tMax;
         vector3 colour;
         Hit* lastHit;
 
     public:
-        Ray () {}
-        Ray (vector3 o, vector3 d) : origin(o), direction(d), colour(vector3{1,0,0}) {}
+        Ray () : sign{0, 0, 0}, shearAxis{0, 1, 2}, shear{0, 0, 1}, tMin(0), tMax(INFINITY) {}
+        Ray (vector3 o, vector3 d) : origin(o), direction(d), tMin(0), tMax(INFINITY), colour(vector3{1,0,0}) {
+            for (int a = 0; a < 3; a++) {
+                invDirection.atr[a] = 1 / direction.atr[a];
+                sign[a] = invDirection.atr[a] < 0;
+            }
+
+            int kz = 0;
+            if (std::abs(direction.atr[1]) > std::abs(direction.atr[kz])) { kz = 1; }
+            if (std::abs(direction.atr[2]) > std::abs(direction.atr[kz])) { kz = 2; }
+            int kx = (kz + 1) % 3;
+            int ky = (kx + 1) % 3;
+            if (direction.atr[kz] < 0) { std::swap(kx, ky); } //keeps the winding, so U V W keep their signs
+            shearAxis[0] = kx;
+            shearAxis[1] = ky;
+            shearAxis[2] = kz;
+            shear[0] = direction.atr[kx] / direction.atr[kz];
+            shear[1] = direction.atr[ky] / direction.atr[kz];
+            shear[2] = 1 / direction.atr[kz];
+        }
         ~Ray () { }
 
         vector3 getOrigin () const { return origin; } 
         vector3 getDirection () const { return direction; }
+        const vector3& getInvDirection () const { return invDirection; }
+        int getSign (int axis) const { return sign[axis]; }
+        int getShearAxis (int i) const { return shearAxis[i]; }
+        double getShear (int i) const { return shear[i]; }
+        double getTMin () const { return tMin; }
+        double getTMax () const { return tMax; }
+        bool inInterval (double t) const { return t >= tMin && t <= tMax; }
         vector3 getColour () const { return colour; }
         //std::list<Hit*> getHits () const { return hits; }
         Hit* getLastHit () const { return lastHit; }
@@ -78,6 +125,9 @@ class Ray {
             return origin + (direction * pos);
         }
 
+        void setInterval (double mi, double ma) { tMin = mi; tMax = ma; }
+        void setTMax (double t) { tMax = t; }
+
         void addHit (Hit* hit) { lastHit = hit; }
         //void clearHit () {  hits.clear(); } //given how the ray is redefined upon a bounce, this probably isn't needed
         void setColour (vector3 c) { colour = c; }
@@ -0,0 +1,211 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <vector>
+#include "vector_helper.h"
+#include "shape.h"
+#include "ray.h"
+#include "acceleration hierarchy.h"
+#include "tile_frustum.h"
+
+/*
+==================================================================================================
+Ray packets: camera rays through neighbouring pixels are traced through the binary BVH together, PACKET_SIZE at a time.
+The packet shares one traversal stack; every entry carries a bitmask of the lanes (rays) still interested in it, and a node
+only goes on if at least one of those lanes hits its box. So the node fetches, stack pushes and pops are paid once for the whole
+packet rather than once per ray, and the box tests run over the lanes in one tight loop.
+
+Coherent rays agree on most nodes; when they don't, the packet thins out. Once fewer than PACKET_MIN_ACTIVE lanes want a
+subtree, they each finish it as single rays (findClosestFrom()) rather than dragging the rest of the packet's bookkeeping along.
+The results are the same as tracing the rays one by one, ties included.
+==================================================================================================
+*/
+
+const int PACKET_SIZE = 8;        //lanes; the mask is an int, so up to 32 would do
+const int PACKET_MIN_ACTIVE = 2;  //below this many lanes, a subtree is finished with single rays
+
+// The lanes' ray data in structure-of-arrays form, for the box tests; lanes past count are dead & never hit anything
+struct RayPacket {
+    Ray* rays[PACKET_SIZE];
+    int count;
+    double origin[3][PACKET_SIZE];
+    double invDirection[3][PACKET_SIZE];
+    double negative[3][PACKET_SIZE]; //the rays' sign bits; doubles, so the box test's lane loop is all one type & vectorises
+    int signMask[3];                 //the same bits as a lane mask, per axis
+    double tMin[PACKET_SIZE];
+    double tMax[PACKET_SIZE];
+
+    RayPacket (Ray* r, int n) : count(n), signMask{0, 0, 0} {
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            rays[l] = (l < n) ? &r[l] : nullptr;
+            const Ray& ray = r[(l < n) ? l : 0];
+            vector3 o = ray.getOrigin();
+            for (int a = 0; a < 3; a++) {
+                origin[a][l] = o.atr[a];
+                invDirection[a][l] = ray.getInvDirection().atr[a];
+                negative[a][l] = ray.getSign(a);
+                if (l < n && ray.getSign(a)) { signMask[a] |= 1 << l; }
+            }
+            tMin[l] = ray.getTMin();
+            tMax[l] = (l < n) ? ray.getTMax() : -INFINITY;
+        }
+    }
+
+    int allLanes () const { return (1 << count) - 1; }
+};
+
+int laneCount (int mask) {
+    int n = 0;
+    for (; mask; mask &= mask - 1) { n++; }
+    return n;
+}
+
+// Slab test of every lane against a node's box (the same sums as LinearBVHNode::intersect); returns the lanes of mask that hit.
+// all lanes are tested with no early outs, so the compiler can run the lanes side by side (dead lanes miss on their own)
+int intersectPacket (const LinearBVHNode& node, const RayPacket& packet, int mask) {
+    double rayMin[PACKET_SIZE];
+    double rayMax[PACKET_SIZE];
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        rayMin[l] = packet.tMin[l];
+        rayMax[l] = packet.tMax[l];
+    }
+
+    for (int a = 0; a < 3; a++) {
+        double lower = node.minimums[a];
+        double upper = node.maximums[a];
+        for (int l = 0; l < PACKET_SIZE; l++) {
+            double tLower = (lower - packet.origin[a][l]) * packet.invDirection[a][l];
+            double tUpper = (upper - packet.origin[a][l]) * packet.invDirection[a][l];
+            double t0 = packet.negative[a][l] ? tUpper : tLower;
+            double t1 = packet.negative[a][l] ? tLower : tUpper;
+            rayMin[l] = (t0 > rayMin[l]) ? t0 : rayMin[l];
+            rayMax[l] = (t1 < rayMax[l]) ? t1 : rayMax[l];
+        }
+    }
+
+    int hits = 0;
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        if (!(rayMax[l] < rayMin[l])) { hits |= 1 << l; }
+    }
+    return hits & mask;
+}
+
+struct PacketStackEntry {
+    int index;
+    int mask;
+};
+
+/*
+Closest shapes for the lanes in lanes, within the subtree under node root; closest[l] is kept unless lane l finds closer (as with
+findClosestFrom()), and each ray's tMax is pulled in to its hit.
+Children are visited nearest first, lane by lane; coherent rays agree on which child that is, so the packet rarely splits over it.
+*/
+void findClosestPacketFrom (const LinearBVH* bvh, RayPacket& packet, int root, int lanes, Shape* closest[PACKET_SIZE], int& checks) {
+    PacketStackEntry stackBuffer[BVH_STACK_SIZE];
+    std::vector<PacketStackEntry> bigStack;
+    PacketStackEntry* stack = stackBuffer;
+    if (3 * bvh->maxDepth + 4 > BVH_STACK_SIZE) { //every level nets at most 3 more entries
+        bigStack.resize(3 * bvh->maxDepth + 4);
+        stack = bigStack.data();
+    }
+    int stackSize = 0;
+    stack[stackSize++] = {root, lanes};
+
+    while (stackSize > 0) {
+        PacketStackEntry entry = stack[--stackSize];
+        const LinearBVHNode& node = bvh->nodes[entry.index];
+        checks++;
+
+        int mask = intersectPacket(node, packet, entry.mask);
+        if (!mask) { continue; }
+
+        if (laneCount(mask) < PACKET_MIN_ACTIVE) {
+            for (int l = 0; l < packet.count; l++) {
+                if (!(mask & (1 << l))) { continue; }
+                closest[l] = findClosestFrom(bvh, *packet.rays[l], entry.index, closest[l], checks);
+                packet.tMax[l] = packet.rays[l]->getTMax();
+            }
+            continue;
+        }
+
+        if (node.primCount > 0) {
+            for (int i = node.offset; i < node.offset + node.primCount; i++) {
+                Shape* s = bvh->prims[i];
+                for (int l = 0; l < packet.count; l++) {
+                    if (!(mask & (1 << l))) { continue; }
+                    double t = s->hitDistance(*packet.rays[l]);
+                    if (t >= 0 && (!closest[l] || t < packet.tMax[l])) { //ties go to the shape found first, as with single rays
+                        packet.rays[l]->setTMax(t);
+                        packet.tMax[l] = t;
+                        closest[l] = s;
+                    }
+                }
+            }
+            continue;
+        }
+
+        //left child sits straight after its parent, right child is at offset; the nearer goes on top.
+        //lanes that disagree on which is nearer get entries of their own, so every lane sees its nodes in the same order a
+        //single ray would - which keeps ties going the same way too
+        int leftFar = mask & packet.signMask[node.axis];
+        int rightFar = mask & ~packet.signMask[node.axis];
+        if (leftFar) {
+            stack[stackSize++] = {entry.index + 1, leftFar};
+            stack[stackSize++] = {node.offset, leftFar};
+        }
+        if (rightFar) {
+            stack[stackSize++] = {node.offset, rightFar};
+            stack[stackSize++] = {entry.index + 1, rightFar};
+        }
+    }
+}
+
+/*
+Closest shape along every ray of the packet; closest[l] gets lane l's shape (or nullptr), and each ray's tMax is pulled in to
+its hit, exactly as findClosest() would leave it.
+Given the cut of the tree for the packet's tile (tile_frustum.h), the walk starts from its candidates instead of the root; the
+expanded nodes above them are taken nearest first, lane by lane, just as the BVH's own nodes are.
+*/
+void findClosestPacket (const LinearBVH* bvh, RayPacket& packet, Shape* closest[PACKET_SIZE], int& checks, const TileCut* tile = nullptr) {
+    for (int l = 0; l < PACKET_SIZE; l++) { closest[l] = nullptr; }
+    if (!bvh || bvh->nodes.empty() || packet.count == 0) { return; }
+    if (!tile) {
+        findClosestPacketFrom(bvh, packet, 0, packet.allLanes(), closest, checks);
+        return;
+    }
+    if (tile->empty()) { return; } //the whole tree is outside the tile's frustum
+
+    PacketStackEntry stackBuffer[BVH_STACK_SIZE]; //indices into the tile's nodes, this time
+    std::vector<PacketStackEntry> bigStack;
+    PacketStackEntry* stack = stackBuffer;
+    if (3 * tile->depth + 4 > BVH_STACK_SIZE) {
+        bigStack.resize(3 * tile->depth + 4);
+        stack = bigStack.data();
+    }
+    int stackSize = 0;
+    stack[stackSize++] = {0, packet.allLanes()};
+
+    while (stackSize > 0) {
+        PacketStackEntry entry = stack[--stackSize];
+        const TileNode& tileNode = tile->nodes[entry.index];
+        if (tileNode.candidate) {
+            findClosestPacketFrom(bvh, packet, tileNode.node, entry.mask, closest, checks);
+            continue;
+        }
+
+        const LinearBVHNode& node = bvh->nodes[tileNode.node];
+        int leftFar = entry.mask & packet.signMask[node.axis];
+        int rightFar = entry.mask & ~packet.signMask[node.axis];
+        const int* children = tileNode.children;
+        if (leftFar) {
+            if (children[0] >= 0) { stack[stackSize++] = {children[0], leftFar}; }
+            if (children[1] >= 0) { stack[stackSize++] = {children[1], leftFar}; }
+        }
+        if (rightFar) {
+            if (children[1] >= 0) { stack[stackSize++] = {children[1], rightFar}; }
+            if (children[0] >= 0) { stack[stackSize++] = {children[0], rightFar}; }
+        }
+    }
+}
+
+#endif
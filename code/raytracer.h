@@ -15,6 +15,8 @@
 #include "ray.h"
 #include "colours.h"
 #include "acceleration hierarchy.h"
+#include "ray_packet.h"
+#include "shadow_cache.h"
 
 /*
 ==================================================================================================
@@ -43,40 +45,53 @@ class RayTracer {
         std::list<Hit> hits;
         int bounces;
         std::string type;    //binary, phong, or pathfinder !
-        double renderDistance;
+        double renderDistance; //far plane: nothing further than this along a camera or bounced ray is seen
         int totalObjs;
 
-        RayTracer () {}
-        RayTracer (Camera c, Scene s, std::list<Ray> r, std::list<Hit> h, int b, std::string t, int tO) : cam(c), scene(s), rays(r), hits(h), bounces(b), type(t), renderDistance(10.0), totalObjs(tO) {};
+        RayTracer () : renderDistance(INFINITY) {}
+        RayTracer (Camera c, Scene s, std::list<Ray> r, std::list<Hit> h, int b, std::string t, int tO) : cam(c), scene(s), rays(r), hits(h), bounces(b), type(t), renderDistance(INFINITY), totalObjs(tO) {};
         ~RayTracer () {}
 
         Camera getCamera () const { return cam; }
-        Scene getScene () const { return scene; }
+        Scene& getScene () { return scene; } //by reference, so live edits (see scene.h) reach the scene this tracer renders
 
         //typical rendering functions
         Image renderImage(int samples);
         Hit recursiveIntersect(Ray ray, vector3 look, std::list<Shape*> shapes);
-        vector3 recursiveRaycast(Ray ray, vector3 look, int layer, bool lastWasRefract = false);
-        double simpleShadow (Hit hit);
+        vector3 recursiveRaycast(Ray ray, vector3 look, int layer, bool lastWasRefract = false, ShadowCache* shadowCache = nullptr);
+        vector3 shadeHit(Ray& ray, Hit& closestHit, int bounce, bool lastWasRefract, ShadowCache* shadowCache = nullptr);
+        void packetRaycast(Ray* rays, int count, vector3 look, vector3 colours[PACKET_SIZE], const TileCut* tile = nullptr,
+                           ShadowCache* shadowCache = nullptr);
+        double simpleShadow (Hit hit, ShadowCache* shadowCache = nullptr);
 
         //rendering with threading equations
         Image startThreadedRender(int samples, int threadCount);
         static void partialImageRenderer(RayTracer* r, Image* image, int samples, int rowID, int incr, int width, int pHeight, 
-                                         int trueHeight, double hw, double hh, bool aliasing, vector3 camRight);
+                                         int trueHeight, double hw, double hh, bool aliasing, vector3 camRight, ShadowCache* shadowCache);
 };
 
 //recursively raytraces babey
 //TODO: fix up refraction
-vector3 RayTracer::recursiveRaycast (Ray ray, vector3 look, int bounce, bool lastWasRefract) {
+vector3 RayTracer::recursiveRaycast (Ray ray, vector3 look, int bounce, bool lastWasRefract, ShadowCache* shadowCache) {
 
     if (bounce == bounces) { 
         std::cout << "bounced outta the universe!" << std::endl;
         return {1,1,1}; 
     } //cap out the recursive bouncing once we hit the bounce limit
 
-    Hit closestHit = intersectBVH(cam.getPosition(), ray, scene.getLights(), look, scene.getShapes(), true, true);
+    Hit closestHit;
+    if (scene.getGrid()) { closestHit = intersectBVH(ray, scene.getLights(), look, scene.getGrid(), true); }
+    else if (scene.getWideShapes()) { closestHit = intersectBVH(ray, scene.getLights(), look, scene.getWideShapes(), true); }
+    else if (scene.getCompressedShapes()) { closestHit = intersectBVH(ray, scene.getLights(), look, scene.getCompressedShapes(), true); }
+    else { closestHit = intersectBVH(ray, scene.getLights(), look, scene.getShapes(), true); }
     //std::cout << closestHit.getChecks() << std::endl;
 
+    return shadeHit(ray, closestHit, bounce, lastWasRefract, shadowCache);
+}
+
+//colour of a ray given what it hit (or didn't); reflections & refractions recurse from here.
+//shadowCache is the rendering thread's shadow occluder cache, if it has one
+vector3 RayTracer::shadeHit (Ray& ray, Hit& closestHit, int bounce, bool lastWasRefract, ShadowCache* shadowCache) {
     vector3 reflectColour;
     vector3 refractColour;
     vector3 rayColour = scene.getBGColour();
@@ -96,11 +111,12 @@ vector3 RayTracer::recursiveRaycast (Ray ray, vector3 look, int bounce, bool las
                 vector3 newdir = vectNormalize(reflect(ray.getDirection(), closestHit.getNormal()));
                 //vector3 pNorm = closestHit.getNormal(); //vectNormalize(closestHit.getNormal() - closestHit.getPoint());
                 Ray r = Ray(closestHit.getPoint() + 0.0001 * newdir, newdir);
-                reflectColour = recursiveRaycast(r, pNorm, bounce + 1);
+                r.setTMax(renderDistance);
+                reflectColour = recursiveRaycast(r, pNorm, bounce + 1, false, shadowCache);
             }
 
             //calculate diffuse, specular, and shadows; these will be overwritten if object is refractive
-            double shadows = simpleShadow(closestHit);
+            double shadows = simpleShadow(closestHit, shadowCache);
             rayColour = closestHit.getColour();
             //if (closestHit.getHitID() == 2 && shadows < 1) { rayColour = vector3{0,0,1}; } //colour shadows on cylinder blue; for debug
             //std::cout << shadows << std::endl;
@@ -124,12 +140,14 @@ vector3 RayTracer::recursiveRaycast (Ray ray, vector3 look, int bounce, bool las
                     vector3 newdir = vectNormalize(reflect(ray.getDirection(), closestHit.getNormal()));
                     //vector3 pNorm = closestHit.getNormal(); //vectNormalize(closestHit.getNormal() - closestHit.getPoint());
                     Ray r = Ray(closestHit.getPoint() + 0.0001 * newdir, newdir);
-                    rayColour = recursiveRaycast(r, pNorm, bounce + 1, true);
+                    r.setTMax(renderDistance);
+                    rayColour = recursiveRaycast(r, pNorm, bounce + 1, true, shadowCache);
                 }
                 else {
                     vector3 newDir = refractiveIndexRatio * dir + (refractiveIndexRatio * cosTheta - sqrt(discriminant)) * pNorm;
                     Ray r = Ray(closestHit.getPoint() + 0.0001 * newDir, newDir);
-                    rayColour = recursiveRaycast(r, pNorm, bounce + 1);
+                    r.setTMax(renderDistance);
+                    rayColour = recursiveRaycast(r, pNorm, bounce + 1, false, shadowCache);
                     shadows = 1;
                 }
             }
@@ -148,44 +166,61 @@ vector3 RayTracer::recursiveRaycast (Ray ray, vector3 look, int bounce, bool las
     return rayColour;
 }
 
+//camera rays through neighbouring pixels, traced through the binary BVH as one packet (ray_packet.h) & then shaded one by one;
+//colours[i] gets the same colour recursiveRaycast(rays[i], look, 0) would give. tile is the cut of the tree for the pixels' tile
+void RayTracer::packetRaycast (Ray* rays, int count, vector3 look, vector3 colours[PACKET_SIZE], const TileCut* tile, ShadowCache* shadowCache) {
+    RayPacket packet(rays, count);
+    Shape* closest[PACKET_SIZE];
+    int checks = 0; //debugging acceleration only
+    findClosestPacket(scene.getShapes(), packet, closest, checks, tile);
+
+    for (int l = 0; l < count; l++) {
+        Hit closestHit = closest[l] ? closest[l]->intersect(rays[l], scene.getLights(), look, true) : Hit();
+        closestHit.setChecks(checks);
+        colours[l] = shadeHit(rays[l], closestHit, 0, false, shadowCache);
+    }
+}
+
 /*
 Calculates whether a given pixel should be in shadow or not.
 Currently ignores shadows on shapes caused by the same shape; caused visual issues when combined with phong shading.
+Shadow rays only need a yes / no answer, so they use the any-hit findOccluder() query rather than a full closest-hit traversal.
+Given a shadow cache (shadow_cache.h), the last shape to block each light is tried before that query.
 TODO: introduce a more advanced shadow calculation method when moving forward with BDSF raytracing.
 */
-double RayTracer::simpleShadow (Hit hit) {
+double RayTracer::simpleShadow (Hit hit, ShadowCache* shadowCache) {
 
     vector3 position = hit.getPoint();
     double shadowMultiplier = 1;
     int lightCount = scene.getLights().size();
 
     //should shadows ignore their own objects? tricky one
+    int lightIndex = -1;
     for (LightSource* light : scene.getLights()) {
+        lightIndex++;
         vector3 lpos = light->getPosition();
         vector3 lightDir = vectNormalize(lpos - position);
         double distance = (lpos - position).magnitude();
-        //std::cout << "Dist: " << distance << std::endl;
         Ray lightRay = Ray(position, lightDir);
-
-        Hit closestHit = intersectBVH(cam.getPosition(), lightRay, scene.getLights(), cam.getLook(), scene.getShapes(), false);
-
-        if (closestHit.getHitID() != hit.getHitID()) {
-            if (closestHit.getT() > 0.0 && closestHit.getT() <= distance) { 
-                shadowMultiplier -= 0.5 / lightCount; 
-                if (hit.getHitID() == 99) {
-                    std::cout << "hit; closest hit id: " << closestHit.getHitID() << std::endl;
-                }
-            }
-            else { 
-                if (hit.getHitID() == 99) {
-                    std::cout << "miss 1; closest hit id: " << closestHit.getHitID() << std::endl;
-                }
-            } 
+        lightRay.setInterval(RAY_EPSILON, distance); //off the surface, up to the light
+
+        //the last shape to block this light is tried before the full query
+        Shape* cached = shadowCache ? shadowCache->occluderFor(lightIndex) : nullptr;
+        Shape* occluder = nullptr;
+        if (cached && cached->occludes(lightRay, hit.getHitID(), hit.getInstanceID())) {
+            occluder = cached;
+            shadowCache->hits++;
         }
         else {
-            if (hit.getHitID() == 99) {
-                std::cout << "miss 2; closest hit id: " << closestHit.getHitID() << std::endl;
-            }
+            if (shadowCache) { shadowCache->misses++; }
+            if (scene.getGrid()) { occluder = findOccluder(scene.getGrid(), lightRay, hit.getHitID(), hit.getInstanceID()); }
+            else if (scene.getWideShapes()) { occluder = findOccluder(scene.getWideShapes(), lightRay, hit.getHitID(), hit.getInstanceID()); }
+            else if (scene.getCompressedShapes()) { occluder = findOccluder(scene.getCompressedShapes(), lightRay, hit.getHitID(), hit.getInstanceID()); }
+            else { occluder = findOccluder(scene.getShapes(), lightRay, hit.getHitID(), hit.getInstanceID()); }
+        }
+        if (occluder) {
+            shadowMultiplier -= 0.5 / lightCount;
+            if (shadowCache) { shadowCache->occluderFor(lightIndex) = occluder; }
         }
     }
 
@@ -196,6 +231,13 @@ double RayTracer::simpleShadow (Hit hit) {
 //Somehow this works and it's beautiful
 Image RayTracer::startThreadedRender(int samples, int threadCount) {
         
+    //pick up any live edits made to the scene since the last render
+    auto commitStart = std::chrono::steady_clock::now();
+    if (scene.commitEdits()) {
+        std::cout << "Committed scene edits in " << nanosecondsSince(commitStart) * 1e-9 << "s ("
+                  << scene.getEditableShapes()->size() << " shapes, " << scene.getShapes()->nodes.size() << " nodes)" << std::endl;
+    }
+
     //Initialise renderer - this step is exactly the same as renderImage();
     int imageWidth = cam.getWidth();
     int imageHeight = cam.getHeight();
@@ -213,6 +255,7 @@ Image RayTracer::startThreadedRender(int samples, int threadCount) {
     Image image = Image(imageWidth, imageHeight);
 
     Image* partials[threadCount];
+    std::vector<ShadowCache> shadowCaches(threadCount); //one per thread, so they needn't be locked
     std::vector<std::thread> threads;
     auto start = std::chrono::system_clock::now();
 
@@ -220,7 +263,7 @@ Image RayTracer::startThreadedRender(int samples, int threadCount) {
     for (int i = 0; i < threadCount; i++) {
         partials[i] = new Image(imageWidth, imageHeight / threadCount);
         threads.emplace_back(&partialImageRenderer, this, partials[i], samples, i, threadCount, imageWidth, imageHeight / threadCount, 
-                             imageHeight, halfWidth, halfHeight, antiAliasing, cameraRight);
+                             imageHeight, halfWidth, halfHeight, antiAliasing, cameraRight, &shadowCaches[i]);
     }
 
     // Join threads
@@ -240,50 +283,113 @@ Image RayTracer::startThreadedRender(int samples, int threadCount) {
     auto end = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsed_seconds = end-start;
     std::cout << "Render Complete!\nElapsed time : " << elapsed_seconds.count() << "s" << std::endl;
+    std::cout << "Primary rays/sec : " << ((double) imageWidth * imageHeight * samples) / elapsed_seconds.count() << std::endl;
+
+    long cacheHits = 0;
+    long cacheMisses = 0;
+    for (const ShadowCache& cache : shadowCaches) {
+        cacheHits += cache.hits;
+        cacheMisses += cache.misses;
+    }
+    if (cacheHits + cacheMisses > 0) {
+        std::cout << "Shadow occluder cache : " << cacheHits << " hits, " << cacheMisses << " misses ("
+                  << (100.0 * cacheHits) / (cacheHits + cacheMisses) << "% of shadow rays answered by one shape)" << std::endl;
+    }
 
     return image;
 } 
 
 //assembles an image the same width as the final render, but with 1/threadCount rows
 //every row in the partial image is a rowID % threadCount row in the final image
-void RayTracer::partialImageRenderer(RayTracer* r, Image* image, int samples, int rowID, int incr, int width, int pHeight, int trueHeight, double hw, double hh, bool aliasing, vector3 camRight) {
+void RayTracer::partialImageRenderer(RayTracer* r, Image* image, int samples, int rowID, int incr, int width, int pHeight, int trueHeight, double hw, double hh, bool aliasing, vector3 camRight, ShadowCache* shadowCache) {
     vector3 origin = r->cam.getPosition();
 
+    //camera ray through pixel (x, y); jittered within the pixel for antialiasing
+    auto primaryRay = [&](int x, int y) {
+        double rayX = x;
+        double rayY = y;
+        if (aliasing) {
+            rayX += 0.5f + (static_cast<double>(rand()) / RAND_MAX - 0.5f);
+            rayY += 0.5f + (static_cast<double>(rand()) / RAND_MAX - 0.5f);
+        }
+    
+        double screenX = (2.0f * (rayX + 0.5f) / width - 1.0f) * hw;
+        double screenY = (1.0f - 2.0f * (rayY + 0.5f) / trueHeight) * hh;
+
+        vector3 xVect = camRight * screenX;
+        vector3 yVect = r->cam.getCamUp() * screenY;
+        vector3 dir = vectNormalize(r->cam.getLook() + xVect + yVect);
+        Ray ray = Ray(origin, dir);
+        ray.setTMax(r->renderDistance); //the far plane; traversal culls every box beyond it
+        return ray;
+    };
+
+    //the frustum of camera rays through pixels x0 to x1 of row y; a sample lands half a pixel to a pixel and a half past the
+    //pixel's corner, and another pixel each way keeps rounding on the safe side
+    auto tileFrustum = [&](int x0, int x1, int y) {
+        double left = (2.0 * (x0 - 0.5) / width - 1.0) * hw;
+        double right = (2.0 * (x1 + 2.5) / width - 1.0) * hw;
+        double top = (1.0 - 2.0 * (y - 0.5) / trueHeight) * hh;
+        double bottom = (1.0 - 2.0 * (y + 2.5) / trueHeight) * hh;
+        vector3 look = r->cam.getLook();
+        vector3 up = r->cam.getCamUp();
+        vector3 corners[4] = {look + camRight * left + up * top, look + camRight * right + up * top,
+                              look + camRight * right + up * bottom, look + camRight * left + up * bottom};
+        return TileFrustum(origin, corners, r->renderDistance);
+    };
+
+    //the mean rgb values of a pixel's samples, toned into the image
+    auto writePixel = [&](int x, int y, vector3 colour) {
+        colour = colour / samples;
+        colour = vectClamp(colour * 1.25, 0.0, 1.0); ; //linear tone mapping; gamma also implemented
+        colour = increaseSaturation(colour, 0.5); //gpt generated script to make colours pop better!
+        image->setPixel(x, y / incr, convertColourVector(colour.toStdVector()));
+    };
+
+    //camera rays go through the binary BVH in packets of PACKET_SIZE neighbouring pixels, one packet per sample, starting from
+    //the subtrees their tile's frustum can see; the other structures (and renders with no bounces, which never trace) go ray by ray
+    bool packets = r->bounces > 0 && !r->scene.getGrid() && !r->scene.getWideShapes() && !r->scene.getCompressedShapes();
+    std::vector<Ray> packetRays(packets ? samples * PACKET_SIZE : 0);
+    TileCut tile;
+
     for (int y = rowID; y < trueHeight; y += incr) {
         //std::cout << rowID << "] Scanlines remaining: " << (pHeight - (y / incr)) << std::endl;
+        if (packets) {
+            for (int x = 0; x < width; x += PACKET_SIZE) {
+                int count = std::min(PACKET_SIZE, width - x);
+                if (x % TILE_WIDTH == 0) { tile.build(r->scene.getShapes(), tileFrustum(x, std::min(x + TILE_WIDTH, width) - 1, y)); }
+
+                //rays are made pixel by pixel as below, so the jitter comes out the same
+                for (int l = 0; l < count; l++) {
+                    for (int i = 0; i < samples; i++) { packetRays[i * PACKET_SIZE + l] = primaryRay(x + l, y); }
+                }
+
+                vector3 colours[PACKET_SIZE];
+                for (int i = 0; i < samples; i++) {
+                    vector3 c[PACKET_SIZE];
+                    r->packetRaycast(&packetRays[i * PACKET_SIZE], count, r->cam.getLook(), c, &tile, shadowCache);
+                    for (int l = 0; l < count; l++) { colours[l] = colours[l] + c[l]; }
+                }
+
+                for (int l = 0; l < count; l++) { writePixel(x + l, y, colours[l]); }
+            }
+            continue;
+        }
+
         for (int x = 0; x < width; x++) {
 
             vector3 colour;
 
             //antialiasing: cast a ray for as mamy samples as there are, set final colour to the mean rgb values
             for (int i = 0; i < samples; i++) {
-
-                double rayX = x;
-                double rayY = y;
-                if (aliasing) {
-                    rayX += 0.5f + (static_cast<double>(rand()) / RAND_MAX - 0.5f);
-                    rayY += 0.5f + (static_cast<double>(rand()) / RAND_MAX - 0.5f);
-                }
-            
-                double screenX = (2.0f * (rayX + 0.5f) / width - 1.0f) * hw;
-                double screenY = (1.0f - 2.0f * (rayY + 0.5f) / trueHeight) * hh;
-
-                vector3 xVect = camRight * screenX;
-                vector3 yVect = r->cam.getCamUp() * screenY;
-                vector3 dir = vectNormalize(r->cam.getLook() + xVect + yVect);
-
-                vector3 pNorm = r->cam.getLook();
-                Ray ray = Ray(origin, dir);
-                vector3 c = r->recursiveRaycast(ray, r->cam.getLook(), 0);
+                Ray ray = primaryRay(x, y);
+                vector3 c = r->recursiveRaycast(ray, r->cam.getLook(), 0, false, shadowCache);
 
                 colour = colour + c;
                 //rays.push_back(r);  // -> don't need atm
             }
 
-            colour = colour / samples;
-            colour = vectClamp(colour * 1.25, 0.0, 1.0); ; //linear tone mapping; gamma also implemented
-            colour = increaseSaturation(colour, 0.5); //gpt generated script to make colours pop better!
-            image->setPixel(x, y / incr, convertColourVector(colour.toStdVector()));
+            writePixel(x, y, colour);
         }
     }
 } 
@@ -2,24 +2,106 @@
 #define SCENE_H
 #include <vector>
 #include <list>
+#include <memory>
 #include "shape.h"
 #include "vector_helper.h"
 #include "lightsource.h"
 #include "acceleration hierarchy.h"
+#include "bvh_compressed.h"
+#include "uniform_grid.h"
+#include "dynamic_bvh.h"
+
+//a scene's live edit state. Scenes get copied about (loadScene hands one to its RayTracer by value), so it's shared between
+//every copy of a scene; an edit made through any of them reaches the one being rendered
+struct SceneEdits {
+    DynamicBVH* tree = nullptr;  //takes the scene's edits; made on the first one
+    LinearBVH* shapes = nullptr; //the BVH the scene renders with once it's been edited; a new one for scenes on a grid
+    bool edited = false;         //edits are waiting to be committed
+};
 
 class Scene {
     private:
         vector3 bgcolour;
         std::list<LightSource*> lights;
-        BVHNode* shapes;
+        LinearBVH* shapes;
+        LinearBVH4* wideShapes; //4-wide copy of shapes; only built when asked for, and used instead of shapes if so
+        CompressedBVH* compressedShapes; //quantized copy of shapes; likewise
+        UniformGrid* grid; //used instead of any BVH when the scene suits one (there's no BVH at all then)
+        BVHBuildSettings buildSettings; //what the BVH was built with; committed edits are written out to the same leaf size
+        std::shared_ptr<SceneEdits> edits;
+        std::shared_ptr<TriangleTable> triangles; //the intersection data of the scene's triangles; kept for as long as any copy of the scene
+
+        //hands the scene's shapes to a DynamicBVH. A scene on a uniform grid has them inserted one by one into a new BVH,
+        //which it renders with from then on; the grid can't take edits
+        void makeEditable () {
+            if (edits->tree) { return; }
+            if (shapes) {
+                edits->tree = new DynamicBVH(*shapes);
+                edits->shapes = shapes;
+                return;
+            }
+            edits->tree = new DynamicBVH();
+            if (grid) {
+                for (Shape* s : grid->cellPrims) { edits->tree->insert(s); } //a shape spanning several cells is only taken once
+            }
+            edits->shapes = new LinearBVH();
+            edits->edited = true;
+        }
 
     public:
-        Scene () {}
-        Scene (vector3 b, std::list<LightSource*> l, BVHNode* s) : bgcolour(b), lights(l), shapes(s) {}
+        Scene () : shapes(nullptr), wideShapes(nullptr), compressedShapes(nullptr), grid(nullptr), edits(std::make_shared<SceneEdits>()) {}
+        Scene (vector3 b, std::list<LightSource*> l, LinearBVH* s, LinearBVH4* w = nullptr, CompressedBVH* c = nullptr, UniformGrid* g = nullptr,
+               BVHBuildSettings settings = BVHBuildSettings(), std::shared_ptr<TriangleTable> t = nullptr)
+            : bgcolour(b), lights(l), shapes(s), wideShapes(w), compressedShapes(c), grid(g), buildSettings(settings),
+              edits(std::make_shared<SceneEdits>()), triangles(t) {}
 
         vector3 getBGColour () { return bgcolour; }
-        BVHNode* getShapes () { return shapes; }
-        std::list<LightSource*> getLights () { return lights; }
+        LinearBVH* getShapes () { return edits->shapes ? edits->shapes : shapes; }
+        LinearBVH4* getWideShapes () { return wideShapes; }
+        CompressedBVH* getCompressedShapes () { return compressedShapes; }
+        UniformGrid* getGrid () { return edits->tree ? nullptr : grid; }
+        const std::list<LightSource*>& getLights () const { return lights; } //by reference; it's read for every shading & shadow ray
+        DynamicBVH* getEditableShapes () { return edits->tree; }
+
+        /*
+        Live edits, for changing a scene between renders without loading it again. A moved shape is handed over as the shape it
+        replaces (or the same shape, if it was changed in place). Each edit goes straight into a DynamicBVH, and returns false if it
+        makes no sense (removing a shape the scene doesn't have, adding one it does). The scene doesn't own its shapes; removed
+        ones are left alone.
+        commitEdits() writes the edits out to the structures the renderer walks; startThreadedRender() does it before each render.
+        */
+        bool insertShape (Shape* shape) {
+            makeEditable();
+            bool done = edits->tree->insert(shape);
+            edits->edited = edits->edited || done;
+            return done;
+        }
+
+        bool removeShape (Shape* shape) {
+            makeEditable();
+            bool done = edits->tree->remove(shape);
+            edits->edited = edits->edited || done;
+            return done;
+        }
+
+        bool moveShape (Shape* shape, Shape* moved) {
+            makeEditable();
+            bool done = edits->tree->move(shape, moved);
+            edits->edited = edits->edited || done;
+            return done;
+        }
+
+        //re-flattens the binary BVH from the edited tree, and remakes the 4-wide / compressed copies if the scene has them.
+        //everything is rebuilt in place, and the edit state is shared, so every copy of this scene sees the edits too.
+        //Returns false if there was nothing to commit
+        bool commitEdits () {
+            if (!edits->tree || !edits->edited) { return false; }
+            edits->tree->flatten(*edits->shapes, buildSettings.maxLeafSize);
+            if (wideShapes) { *wideShapes = LinearBVH4(*edits->shapes); }
+            if (compressedShapes) { *compressedShapes = CompressedBVH(*edits->shapes, compressedShapes->bits); }
+            edits->edited = false;
+            return true;
+        }
 };
 
 #endif
\ No newline at end of file
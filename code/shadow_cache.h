@@ -0,0 +1,31 @@
+#ifndef SHADOW_CACHE_H
+#define SHADOW_CACHE_H
+
+#include <vector>
+#include "shape.h"
+
+/*
+==================================================================================================
+Shadow occluder cache: neighbouring shading points are nearly always shadowed from a light by the same shape, so each render
+thread remembers, per light, the last shape that blocked a shadow ray. The next shadow ray towards that light tries it first
+and only walks the acceleration structure if it doesn't block; a lit point walks it as before.
+A blocker is a blocker - the cached one gives the same yes / no answer the full query would, so renders don't change.
+The cache belongs to one thread, so there's no locking; the counters are summed once the threads are done.
+==================================================================================================
+*/
+
+class ShadowCache {
+    public:
+        std::vector<Shape*> occluders; //last blocker per light, in the scene's light order (nullptr until there is one)
+        long hits;                     //shadow rays the cached shape answered on its own
+        long misses;                   //shadow rays that needed a full occlusion query
+
+        ShadowCache () : hits(0), misses(0) {}
+
+        Shape*& occluderFor (int light) {
+            if (light >= (int) occluders.size()) { occluders.resize(light + 1, nullptr); }
+            return occluders[light];
+        }
+};
+
+#endif
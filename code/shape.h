@@ -8,6 +8,7 @@
 #include "lightsource.h"
 #include "material.h"
 #include "ray.h"
+#include "triangle_table.h"
 
 class Shape {
     protected:
@@ -19,12 +20,42 @@ class Shape {
         Shape (Material m, int ID) : material(m), id(ID) {}
         ~Shape () { }
 
-        virtual Hit intersect (Ray& ray, std::list<LightSource*> l, vector3 camLook, bool calcMaterial = true) { return Hit(); }
+        virtual Hit intersect (Ray& ray, const std::list<LightSource*>& l, vector3 camLook, bool calcMaterial = true) { return Hit(); }
+        //just the distance along the ray to the intersection (-1 on a miss, or if it's outside the ray's tMin - tMax);
+        //no normals, textures, or shading. traversal uses this to find the closest shape, and only calls intersect() on the winner
+        virtual double hitDistance (Ray& ray) { return -1; }
+        //shadow test: does this shape block the ray within its interval? Shapes never shadow themselves, so the shape with id
+        //ignoreID doesn't count; ignoreInstanceID is only needed by instances, to tell which copy of a shape is the one being shaded
+        virtual bool occludes (Ray& ray, int ignoreID, int /*ignoreInstanceID*/ = -1) {
+            if (id == ignoreID) { return false; }
+            return hitDistance(ray) >= 0;
+        }
         virtual vector3 mapTexture (Ray& ray, vector3 hit, vector3 hitNormal = {0,0,0}) { return {0,0,0}; }
+        //colours hit with this shape's material (or by its normal, if it has none), lit by l & seen along camLook. intersect()
+        //does it when calcMaterial is set; instances do it themselves, once their shape's hit is back in world space
+        void shade (Hit& hit, const std::list<LightSource*>& l, vector3 camLook) {
+            if (material.exists()) {
+                hit.setColour(material.calculatePhongShading(&hit, hit.getNormal(), hit.getPoint(), l, camLook, hit.getTexCoords()));
+            } else {
+                hit.setColour(0.5 * (hit.getNormal() + vector3{1,1,1})); //colour with normals
+            }
+        }
 
+        int getID () const { return id; }
+        virtual int idCount () { return 1; } //ids the shape takes up, from its own on; meshes give each of their triangles one
         virtual vector3 getCenter () { return {0,0,0}; }
         virtual vector3 getMinimums () { return {0,0,0}; }
         virtual vector3 getMaximums () { return {0,0,0}; }
+        //bounds of the part of this shape lying between lo & hi along one axis; false if none of it does.
+        //the spatial split builder uses it to shrink the box of a shape it has cut in two, so shapes that can do better than
+        //chopping their whole bounding box (triangles) should override it
+        virtual bool clipBounds (int axis, double lo, double hi, vector3& mi, vector3& ma) {
+            mi = getMinimums();
+            ma = getMaximums();
+            mi.atr[axis] = std::max(mi.atr[axis], lo);
+            ma.atr[axis] = std::min(ma.atr[axis], hi);
+            return mi.atr[axis] <= ma.atr[axis];
+        }
         virtual std::string getType () { return "null"; }
 };
 
@@ -41,44 +72,37 @@ class Sphere : public Shape {
         std::string getType () override { return "sphere"; }
 
         // Function to calculate the intersection points with a sphere
-        Hit intersect (Ray& ray, std::list<LightSource*> l, vector3 camLook, bool calcMaterial = true) override {
-            double threshold = 0;
-            if (!calcMaterial) {threshold = 1e-4;}
-            
+        Hit intersect (Ray& ray, const std::list<LightSource*>& l, vector3 camLook, bool calcMaterial = true) override {
+            double t = hitDistance(ray);
+            if (t < 0) { return Hit(); }
+
+            //calculate normal vector
+            vector3 norm = vectNormalize(ray.at(t) - center);
+            Hit hit = Hit(t, ray.at(t), norm, vector3{0,0,0}, id, material.getReflectivity(), material.getRefIndex());
+            hit.setTexCoords(mapTexture(ray, norm));
+            if (calcMaterial) { shade(hit, l, camLook); }
+
+            return hit;
+        }
+
+        double hitDistance (Ray& ray) override {
+            double threshold = ray.getTMin();
             vector3 OC = ray.getOrigin() - center;
             float a = dotProduct(ray.getDirection(), ray.getDirection());
             float b = 2.0f * dotProduct(OC, ray.getDirection());
             float c = dotProduct(OC, OC) - radius * radius;
             float discriminant = b * b - 4 * a * c;
 
-            if (discriminant < 0) {
-                // No intersection
-                return Hit();
-            } else {
-
-                //can get the intersection points if we need them later
-                double t1 = (-b - std::sqrt(discriminant)) / (2.0f * a);
-                double t2 = (-b + std::sqrt(discriminant)) / (2.0f * a);
-                double t = t1;
-                if ((t2 < t1 && t2 >= threshold) || (t1 < threshold)) {t = t2;}
-                if (t < threshold) {return Hit();} //best intersection is behind the camera; nevermind we can't see this boy!
-
-                //calculate normal vector
-                vector3 norm = vectNormalize(ray.at(t) - center);
-                vector3 colourNorm = 0.5 * (norm + vector3{1,1,1});
-                Hit* hit = new Hit(t, ray.at(t), norm, vector3{0,0,0}, id, material.getReflectivity(), material.getRefIndex());
-                vector3 textureMap = mapTexture(ray, norm);
-
-                if (calcMaterial) {
-                    if (material.exists()) {
-                        hit->setColour(material.calculatePhongShading(hit, norm, ray.at(t), l, camLook, textureMap));
-                    } else {
-                        hit->setColour(colourNorm); //colour with normals
-                    }
-                }
+            if (discriminant < 0) { return -1; } // No intersection
 
-                return *hit;
-            }
+            //can get the intersection points if we need them later
+            double t1 = (-b - std::sqrt(discriminant)) / (2.0f * a);
+            double t2 = (-b + std::sqrt(discriminant)) / (2.0f * a);
+            double t = t1;
+            if ((t2 < t1 && t2 >= threshold) || (t1 < threshold)) {t = t2;}
+            if (t < threshold) {return -1;} //best intersection is behind the camera; nevermind we can't see this boy!
+            if (t > ray.getTMax()) { return -1; }
+            return t;
         }
 
         //calculate position on texture file to get, if texture file is present in material
@@ -87,7 +111,7 @@ class Sphere : public Shape {
 
             float scaleFactor = 0.5f; //2.0f / (1.0f + pos.z()); // Scaling factor
             vector3 pos = vectNormalize(hit); //ensure normalisation
-            Image diffTex = material.getTexture();
+            Image& diffTex = material.getTexture();
 
             // Projected coordinates on the 2D image
             double xImage = ((clamp(pos.x(), -1, 1)  * scaleFactor) * diffTex.getWidth())  + (diffTex.getWidth() / 2);  //* 0.5f * diffTex.getWidth();
@@ -116,9 +140,8 @@ class Cylinder : public Shape {
         std::string getType () override { return "cylinder"; }
 
         //After weeks this bad boy finally renders correctly
-        Hit intersect(Ray& ray, std::list<LightSource*> l, vector3 camLook, bool calcMaterial = true) override {
-            double threshold = 0;
-            if (!calcMaterial) {threshold = 1e-4;}
+        Hit intersect(Ray& ray, const std::list<LightSource*>& l, vector3 camLook, bool calcMaterial = true) override {
+            double threshold = ray.getTMin();
             
             //i was having issues where the axis translated the cylinder
             //thus, this counteracts that by translating the cylinder by -axis prior to calculation
@@ -158,16 +181,8 @@ class Cylinder : public Shape {
             vector3 radialComponent = vectorToSurface - axisComponent;
             vector3 norm  = /*-*/vectNormalize(radialComponent); //gpt inverted this for some reason lol
             Hit* hit = new Hit(t, ray.at(t), norm, vector3{0,0,0}, id, material.getReflectivity(), material.getRefIndex());
-            vector3 textureMap = mapTexture(ray, ray.at(t), norm);
-
-            if (calcMaterial) {
-                vector3 colourNorm = 0.5 * (norm + vector3{1,1,1});
-                if (material.exists()) {
-                    hit->setColour(material.calculatePhongShading(hit, norm, ray.at(t), l, camLook, textureMap));
-                } else {
-                    hit->setColour(colourNorm); //colour with normals
-                }
-            }
+            hit->setTexCoords(mapTexture(ray, ray.at(t), norm));
+            if (calcMaterial) { shade(*hit, l, camLook); }
         
             // Check if the intersection point is within the height of the cylinder
             double z = dotProduct(tO - tC, axis) + t * dotProduct(dir, axis);
@@ -182,13 +197,60 @@ class Cylinder : public Shape {
 
         }
 
+        //mirrors intersect() + capCheck() without building any hits
+        double hitDistance (Ray& ray) override {
+            double threshold = ray.getTMin();
+            vector3 tO = (ray.getOrigin() - axis);
+            vector3 tC = (center - axis);
+
+            vector3 OC = tO - tC;
+            vector3 dir = ray.getDirection();
+
+            vector3 p1 = dir - (axis * dotProduct(dir, axis));
+            vector3 p2 = OC - (axis * dotProduct(OC, axis));
+            double a = dotProduct(p1 , p1);
+            double b = 2.0f * dotProduct(p2, p1);
+            double c = dotProduct(p2, p2) - radius * radius;
+
+            double discriminant = b * b - 4 * a * c;
+            if (discriminant < 0) { return rayCapDistance(ray); }
+
+            double t1 = (-b - std::sqrt(discriminant)) / (2 * a);
+            double t2 = (-b + std::sqrt(discriminant)) / (2 * a);
+            double t = t1;
+            if ((t2 < t1 && t2 >= threshold) || (t1 < threshold)) {t = t2;}
+            if (t < threshold) { return -1; }
+
+            double z = dotProduct(tO - tC, axis) + t * dotProduct(dir, axis);
+            if (z >= -height && z <= height) { return (t <= ray.getTMax()) ? t : -1; }
+            return rayCapDistance(ray);
+        }
+
+        //capDistance(), but only if it's within the ray's interval
+        double rayCapDistance (Ray& ray) {
+            double t = capDistance(ray);
+            return ray.inInterval(t) ? t : -1;
+        }
+
+        //distance to whichever cap capCheck() would pick; can be negative if that cap is behind the ray
+        double capDistance (Ray& ray) {
+            vector3 origin = ray.getOrigin();
+            vector3 direction = ray.getDirection();
+
+            double top = dotProduct((center + (height) * axis - origin), axis) / dotProduct(direction,axis);
+            double bot = dotProduct((center + (height) * -axis - origin), axis) / dotProduct(direction,axis);
+            if (std::pow((ray.at(top) - center - (height) * axis).magnitude(), 2) <= radius * radius) { return top; }
+            if (std::pow((ray.at(bot) - center - (height) * -axis).magnitude(), 2) <= radius * radius) { return bot; }
+            return -1;
+        }
+
         //texture mapper for the main body of the cylinder
         vector3 mapTexture(Ray& ray, vector3 hit, vector3 hitNormal = {0,0,0}) override {
             if (!material.hasTexture()) { return {0,0,0}; }
 
             float scaleFactor = 0.5; //2.0f / (1.0f + pos.z()); // Scaling factor
             vector3 pos = hit - getCenter(); //ensure normalisation
-            Image diffTex = material.getTexture();
+            Image& diffTex = material.getTexture();
 
             vector3 axisPair = {0,2,1}; //atr[] indexes relating to relative axis of the circular cap
             if (axis.x() == 1) { axisPair = {2,1,0}; }
@@ -208,7 +270,7 @@ class Cylinder : public Shape {
         }
 
         //if ray does not interact with the main part of the cylinder, check the caps!
-        Hit capCheck(Ray& ray, std::list<LightSource*> l, vector3 camLook, bool calcMaterial = true) {
+        Hit capCheck(Ray& ray, const std::list<LightSource*>& l, vector3 camLook, bool calcMaterial = true) {
             vector3 origin = ray.getOrigin();
             vector3 direction = ray.getDirection();
             double threshold = 0;
@@ -234,6 +296,7 @@ class Cylinder : public Shape {
                 t = bot;
             }
             else { return Hit(); }
+            hit->setTexCoords(textureMap);
 
             if (calcMaterial) {
                 vector3 colourNorm = 0.5 * (axis + vector3{1,1,1});
@@ -270,7 +333,7 @@ class Cylinder : public Shape {
         //texture mapper for the caps of the cylinders; 
         vector3 mapCapTexture (Ray& ray, vector3 hit, vector3 normal) {
             if (!material.hasTexture()) { return {0,0,0}; }
-            Image tex = material.getTexture();
+            Image& tex = material.getTexture();
 
             //Nothing fancy, I'm just gonna map the normalised distance from the centre
             vector3 axisPair = {0,1,-1}; //atr[] indexes relating to relative axis of the circular cap
@@ -294,9 +357,17 @@ class Triangle : public Shape {
         vector3 v0;
         vector3 v1;
         vector3 v2;
+        const TriangleTable* table; //holds this triangle's intersection data, under handle (the table moves it about when it's reordered)
+        int handle;
 
     public:
-        Triangle (vector3 z, vector3 o, vector3 t, Material m, int id) : Shape(m, id), v0(z), v1(o), v2(t) {}
+        //the triangle's data goes into table straight away; the table has to outlive the triangle
+        Triangle (vector3 z, vector3 o, vector3 t, Material m, int id, TriangleTable* triangles) : Shape(m, id), v0(z), v1(o), v2(t),
+                                                                                                  table(triangles), handle(triangles->add(z, o, t)) {}
+
+        const TriangleTable* getTable () const { return table; }
+        int getSlot () const { return table->slotOf(handle); }
+        vector3 getVertex (int i) const { return i == 0 ? v0 : (i == 1 ? v1 : v2); }
 
         std::string getExistance();
         vector3 getCenter () override { 
@@ -307,62 +378,25 @@ class Triangle : public Shape {
         }
         std::string getType () override { return "tri"; }
 
-        Hit intersect (Ray& ray, std::list<LightSource*> l, vector3 camLook, bool calcMaterial = true) override {
-            double threshold = 0;
-            if (!calcMaterial) {threshold = 1e-4;}
+        Hit intersect (Ray& ray, const std::list<LightSource*>& l, vector3 camLook, bool calcMaterial = true) override {
+            double t = hitDistance(ray);
+            if (t < 0) { return Hit(); }
 
-            // Calculate the normal to the triangle
-            vector3 normal = crossProduct(v1 - v0, v2 - v0);
-            //std::cout << normal.x() << " : " << normal.y() <<  " : "  << normal.z() << std::endl;
-
-            // Check if the ray is parallel to the triangle (dot product with the normal is close to zero)
-            double dotProd = dotProduct(ray.getDirection(), normal);
-            if (std::abs(dotProd) < 1e-6) {
-                // Ray is parallel to the triangle, no intersection
-                return Hit();
-            }
-
-            // Calculate the distance along the ray where it intersects the plane of the triangle
-            double t = dotProduct(v0 - ray.getOrigin(), normal) / dotProd;
-
-            if (t < threshold) { return Hit(); } //intersection point is behind the camera! silly silly
-            vector3 colour;
-
-            // Calculate the intersection point
+            // The normal to the triangle (precomputed) & the intersection point
+            vector3 normal = table->getNormal(getSlot());
             vector3 intersectionPoint = ray.at(t);
-            Hit* hit = new Hit(t, intersectionPoint, vectNormalize(normal), vector3{0,0,0}, id, material.getReflectivity(), material.getRefIndex());
-
-            // Check if the intersection point is inside the triangle
-            vector3 edge1 = v1 - v0;
-            vector3 edge2 = v2 - v1;
-            vector3 edge3 = v0 - v2;
-
-            vector3 normal1 = crossProduct(edge1, intersectionPoint - v0);
-            vector3 normal2 = crossProduct(edge2, intersectionPoint - v1);
-            vector3 normal3 = crossProduct(edge3, intersectionPoint - v2);
-
-            // Check if the intersection point is on the same side of each triangle edge
-            if (dotProduct(normal1, normal) >= 0.0f && dotProduct(normal2, normal) >= 0.0f && dotProduct(normal3, normal) >= 0.0f) {
-                vector3 textMap = mapTexture(ray, intersectionPoint, vectNormalize(normal));
-
-                // Colour the hit now that we know the triangle has been hit
-                // vector3 textureMap = mapTexture(ray, intersectionPoint, vectNormalize(normal));
-                if (calcMaterial) {
-                    vector3 colourNorm = 0.5 * (vectNormalize(normal) + vector3{1,1,1});
-                    if (material.exists()) {
-                        hit->setColour(material.calculatePhongShading(hit, vectNormalize(normal), intersectionPoint, l, camLook, textMap));
-                    } else {
-                        hit->setColour(colourNorm); //colour with normals
-                    }
-                }
+            Hit hit = Hit(t, intersectionPoint, normal, vector3{0,0,0}, id, material.getReflectivity(), material.getRefIndex());
+            hit.setTexCoords(mapTexture(ray, intersectionPoint, normal));
 
-                return *hit;
-            }
+            // Colour the hit now that we know the triangle has been hit
+            if (calcMaterial) { shade(hit, l, camLook); }
 
-            // Intersection point is outside the triangle
-            return Hit();
+            return hit;
         }
 
+        //watertight, so a ray through an edge shared with another triangle always hits one of the two
+        double hitDistance (Ray& ray) override { return table->hitDistance(getSlot(), ray); }
+
         //estimate the minimum / maximum points of a bounding box surrounding this geometry
         //used for acelleration hiercarchy box calculation
         vector3 getMinimums () override {
@@ -378,12 +412,46 @@ class Triangle : public Shape {
             return {x, y, z}; 
         }
 
+        //clip the triangle against both planes of the slab (Sutherland-Hodgman) & bound whatever polygon is left
+        bool clipBounds (int axis, double lo, double hi, vector3& mi, vector3& ma) override {
+            vector3 poly[5] = {v0, v1, v2};
+            int count = 3;
+            for (int side = 0; side < 2 && count > 0; side++) {
+                double plane = side == 0 ? lo : hi;
+                double sign = side == 0 ? 1 : -1; //which side of the plane we keep
+                vector3 clipped[5];
+                int clippedCount = 0;
+                for (int i = 0; i < count; i++) {
+                    vector3 a = poly[i];
+                    vector3 b = poly[(i + 1) % count];
+                    double da = sign * (a.atr[axis] - plane);
+                    double db = sign * (b.atr[axis] - plane);
+                    if (da >= 0) { clipped[clippedCount++] = a; }
+                    if ((da < 0) != (db < 0)) { clipped[clippedCount++] = a + (b - a) * (da / (da - db)); }
+                }
+                for (int i = 0; i < clippedCount; i++) { poly[i] = clipped[i]; }
+                count = clippedCount;
+            }
+            if (count == 0) { return false; }
+
+            mi = {INFINITY, INFINITY, INFINITY};
+            ma = {-INFINITY, -INFINITY, -INFINITY};
+            for (int i = 0; i < count; i++) {
+                mi = vectMin(mi, poly[i]);
+                ma = vectMax(ma, poly[i]);
+            }
+            //the intersection points can land a hair outside the slab; keep them inside it
+            mi.atr[axis] = std::max(mi.atr[axis], lo);
+            ma.atr[axis] = std::min(ma.atr[axis], hi);
+            return mi.atr[axis] <= ma.atr[axis];
+        }
+
         //Triangle texture mapper -> maps texture to the plane of the triangle
         //GPT couldn't give me anything good, had to scour stack overflow for transformation maths for a while -
         //shout outs to valdo for the working code: https://stackoverflow.com/a/9605748
         vector3 mapTexture (Ray& ray, vector3 hit, vector3 normal) override {
             if (!material.hasTexture()) { return {0,0,0}; }
-            Image tex = material.getTexture();
+            Image& tex = material.getTexture();
 
             vector3 min = getMinimums();
             vector3 max = getMaximums();
@@ -398,6 +466,16 @@ class Triangle : public Shape {
         }
 };
 
+// Appends the table slots of the triangles in prims to order, in the order they come; with a tree's leaf ordered prims, that
+// gives TriangleTable::reorder() the layout the traversal reads it in
+void appendTriangleSlots (const std::vector<Shape*>& prims, const TriangleTable* table, std::vector<int>& order) {
+    for (Shape* s : prims) {
+        if (s->getType() != "tri") { continue; }
+        Triangle* tri = static_cast<Triangle*>(s);
+        if (tri->getTable() == table) { order.push_back(tri->getSlot()); }
+    }
+}
+
 /*
 Cubes are currently only used for the acceleration hierarchy; they never concretely exist in the scene.
 As such, it is impossible to instantiate one with a material or an ID.
@@ -410,61 +488,19 @@ class Cube : public Shape {
     public:
         Cube () {};
         Cube (vector3 mi, vector3 ma) : Shape(Material(), -1), cubeMin(mi), cubeMax(ma) { }
-        Cube (std::vector<Shape*> shapes, vector3 cam) {
-            Shape(Material());
-            cubeMax = {-INFINITY, -INFINITY, -INFINITY};
-            cubeMin = {INFINITY, INFINITY, INFINITY};
-
-            for (Shape* s : shapes) {
-                vector3 mins = s->getMinimums();
-                cubeMin = {std::min(cubeMin.x(), mins.x()), std::min(cubeMin.y(), mins.y()), std::min(cubeMin.z(), mins.z())};
-                vector3 maxs = s->getMaximums();
-                cubeMax = {std::max(cubeMax.x(), maxs.x()), std::max(cubeMax.y(), maxs.y()), std::max(cubeMax.z(), maxs.z())};
-            }
-
-            reshapeIfOnBoundary(cam);
-
-            //std::cout << "New bounding box:" << std::endl;
-            //std::cout << " * Min -> " << cubeMin.x() << " : " << cubeMin.y() <<  " : "  << cubeMin.z() << std::endl;
-            //std::cout << " * Max -> " << cubeMax.x() << " : " << cubeMax.y() <<  " : "  << cubeMax.z() << std::endl;
-
-        }
-        Cube (Shape* s1, vector3 cam) {
-            Shape(Material());
-
-            cubeMin = {-99,-99,-99};
-            cubeMax = {-99,-99,-99};
-            if (s1->getType() != "null") {
-                cubeMin = s1->getMinimums();
-                cubeMax = s1->getMaximums();
-            }
-
-            reshapeIfOnBoundary(cam);
 
-            //std::cout << "New bounding box [ contains " << s1->getType() << " ] :" << std::endl;
-            //std::cout << " * Min -> " << cubeMin.x() << " : " << cubeMin.y() <<  " : "  << cubeMin.z() << std::endl;
-            //std::cout << " * Max -> " << cubeMax.x() << " : " << cubeMax.y() <<  " : "  << cubeMax.z() << std::endl;
-        }
-
-        Hit intersect (Ray& ray, std::list<LightSource*> l, vector3 camLook, bool calcMaterial = false) override {
-            // Calculate the inverse direction of the ray
-            vector3 dir = ray.getDirection();
+        Hit intersect (Ray& ray, const std::list<LightSource*>& l, vector3 camLook, bool calcMaterial = false) override {
+            const vector3& invDirection = ray.getInvDirection();
             vector3 origin = ray.getOrigin();
-            vector3 invDirection(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
-            double rayMin = -INFINITY;
-            double rayMax = INFINITY;
+            double rayMin = ray.getTMin();
+            double rayMax = ray.getTMax();
 
             //credit for this skin-saving optimised aabb loop is Pixar engineer Andrew Kensler
             //found in the book 'Raytracing: the next week' (Shirley, Black, Hollasch) - chapter 3.5
+            //the ray's sign bits pick the near & far planes up front, so there's no divide or swap per axis
             for (int a = 0; a < 3; a++) {
-                auto invD = 1 / ray.getDirection().atr[a];
-                auto orig = ray.getOrigin().atr[a];
-
-                auto t0 = (cubeMin.atr[a] - orig) * invD;
-                auto t1 = (cubeMax.atr[a] - orig) * invD;
-
-                if (invD < 0)
-                    std::swap(t0, t1);
+                auto t0 = ((ray.getSign(a) ? cubeMax : cubeMin).atr[a] - origin.atr[a]) * invDirection.atr[a];
+                auto t1 = ((ray.getSign(a) ? cubeMin : cubeMax).atr[a] - origin.atr[a]) * invDirection.atr[a];
 
                 if (t0 > rayMin) rayMin = t0;
                 if (t1 < rayMax) rayMax = t1;
@@ -493,6 +529,12 @@ class Cube : public Shape {
         double y () const { return cubeMax.y() - cubeMin.y(); }
         double z () const { return cubeMax.z() - cubeMin.z(); }
 
+        //surface area of the box; the probability of a ray hitting a box is proportional to this, hence the SAH builder loves it
+        double surfaceArea () const {
+            if (x() < 0 || y() < 0 || z() < 0) { return 0; } //empty box
+            return 2 * (x() * y() + y() * z() + z() * x());
+        }
+
         int longestAxis () {
             double x = (cubeMax.x() - cubeMin.x());
             double y = (cubeMax.y() - cubeMin.y());
@@ -501,24 +543,6 @@ class Cube : public Shape {
             else if (y >= x && y >= z) { return 1; }
             return 2;
         }
-
-        //slightly increase the size of the bounding box if the point in question is on an exact edge
-        //being on the exact edge of a box leads to weird behaviour; camera won't render shapes within the boundary of the box,
-        //and shadows will neither render if they are on a boundary (just a problem for triangles)
-        void reshapeIfOnBoundary (vector3 camPos) {
-            if (camPos.y() == cubeMin.y() || camPos.y() == cubeMax.y()) {
-                cubeMin.atr[1] -= 0.001;
-                cubeMax.atr[1] += 0.001;
-            }
-            if (camPos.z() == cubeMin.z() || camPos.z() == cubeMax.z()) {
-                cubeMin.atr[2] -= 0.001;
-                cubeMax.atr[2] += 0.001;
-            }
-            if (camPos.x() == cubeMin.x() || camPos.x() == cubeMax.x()) {
-                cubeMin.atr[0] -= 0.001;
-                cubeMax.atr[0] += 0.001;
-            }
-        }
 };
 
 std::string Triangle::getExistance()
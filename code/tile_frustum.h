@@ -0,0 +1,113 @@
+#ifndef TILE_FRUSTUM_H
+#define TILE_FRUSTUM_H
+
+#include <algorithm>
+#include <vector>
+#include "vector_helper.h"
+#include "acceleration hierarchy.h"
+
+/*
+==================================================================================================
+Tile frustums: every camera ray through a tile (a run of pixels along a row) starts at the camera & passes through the tile's
+patch of the screen, so all of them lie inside the pyramid those four edges make with the camera position. A BVH node wholly
+outside that pyramid can't be hit by any of them.
+Before a tile is traced, the top of the tree is walked once against its frustum; nodes outside are dropped, and the walk stops
+at a short list of candidate subtrees (TILE_CANDIDATES at most). The tile's rays then start from those candidates rather than
+the root - the top levels & off-screen branches (and, with a render distance, far away ones) are decided once per tile
+instead of once per ray.
+The candidates are kept along with the expanded nodes above them, so a ray still reaches them nearest first, in the same order a
+walk from the root would; results (ties included) don't change.
+==================================================================================================
+*/
+
+const int TILE_WIDTH = 32;      //pixels per tile, along a row; a whole number of packets
+const int TILE_CANDIDATES = 16; //most subtrees a tile's rays start from
+
+// The side planes of the pyramid from origin through a quad of directions; nothing can be behind the camera, so no near plane.
+// The far 'plane' is a sphere around origin: the rays are unit length, so their tMax (the render distance) is a distance
+class TileFrustum {
+    public:
+        vector3 origin;
+        vector3 normals[4]; //pointing out of the frustum
+        double far;
+
+        //corners are directions to the quad's corners from origin, in order around it (either way round)
+        TileFrustum (vector3 o, const vector3 corners[4], double f = INFINITY) : origin(o), far(f) {
+            vector3 centre = corners[0] + corners[1] + corners[2] + corners[3];
+            for (int i = 0; i < 4; i++) {
+                normals[i] = crossProduct(corners[i], corners[(i + 1) % 4]);
+                if (dotProduct(normals[i], centre) > 0) { normals[i] = normals[i] * -1; }
+            }
+        }
+
+        //true only if the box is entirely outside one of the planes, or entirely beyond far; boxes it can't rule out count as inside
+        bool outside (const LinearBVHNode& node) const {
+            if (far < INFINITY) {
+                //squared distance from origin to the nearest point of the box
+                double distance = 0;
+                for (int a = 0; a < 3; a++) {
+                    double gap = std::max({(double) node.minimums[a] - origin.atr[a], origin.atr[a] - (double) node.maximums[a], 0.0});
+                    distance += gap * gap;
+                }
+                if (distance > far * far) { return true; }
+            }
+            for (int i = 0; i < 4; i++) {
+                //the corner of the box furthest into the frustum, measured along the plane's normal
+                double nearest = 0;
+                for (int a = 0; a < 3; a++) {
+                    double corner = (normals[i].atr[a] > 0) ? node.minimums[a] : node.maximums[a];
+                    nearest += normals[i].atr[a] * (corner - origin.atr[a]);
+                }
+                if (nearest > 0) { return true; }
+            }
+            return false;
+        }
+};
+
+struct TileNode {
+    int node;        //index into the BVH's nodes
+    int children[2]; //TileNodes of the left & right child; -1 where the child is outside the frustum
+    bool candidate;  //traversal carries on in the BVH from here; otherwise the node was expanded
+};
+
+// The top of the BVH as one tile sees it; nodes[0] is the root (if the root isn't outside the frustum, else nodes is empty)
+class TileCut {
+    public:
+        std::vector<TileNode> nodes;
+        int depth; //deepest candidate; sizes the traversal stack
+
+        TileCut () : depth(0) {}
+
+        void build (const LinearBVH* bvh, const TileFrustum& frustum) {
+            nodes.clear();
+            depth = 0;
+            if (!bvh || bvh->nodes.empty() || frustum.outside(bvh->nodes[0])) { return; }
+            nodes.push_back({0, {-1, -1}, true});
+            std::vector<int> depths(1, 0);
+
+            //expand candidates breadth first (so the top levels go first) while the list stays short enough
+            int candidates = 1;
+            for (int i = 0; i < (int) nodes.size(); i++) {
+                const LinearBVHNode& node = bvh->nodes[nodes[i].node];
+                if (node.primCount > 0) { continue; }
+
+                int children[2] = {nodes[i].node + 1, node.offset};
+                bool inside[2] = {!frustum.outside(bvh->nodes[children[0]]), !frustum.outside(bvh->nodes[children[1]])};
+                if (candidates - 1 + inside[0] + inside[1] > TILE_CANDIDATES) { break; }
+
+                candidates += inside[0] + inside[1] - 1;
+                nodes[i].candidate = false;
+                for (int c = 0; c < 2; c++) {
+                    if (!inside[c]) { continue; }
+                    nodes[i].children[c] = (int) nodes.size();
+                    nodes.push_back({children[c], {-1, -1}, true});
+                    depths.push_back(depths[i] + 1);
+                    depth = std::max(depth, depths[i] + 1);
+                }
+            }
+        }
+
+        bool empty () const { return nodes.empty(); }
+};
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+#include "vector_helper.h"
+#include "matricies.h"
+#include "lightsource.h"
+#include "material.h"
+#include "ray.h"
+#include "shape.h"
+#include "triangle_table.h"
+#include "acceleration hierarchy.h"
+
+/*
+==================================================================================================
+Triangle meshes: a whole model as one shape, for assets far too big to load as a Triangle per face.
+Vertex positions, normals & texture coordinates are kept once each, in floats, in shared arrays; each triangle is just three
+indices into each of them. There's one material for the whole mesh, and no per-triangle object at all.
+The mesh has a BVH of its own over its triangles (built with the SAH builder, flattened into the same 32 byte nodes as the
+scene's), whose leaves index the triangles directly; the triangles are stored in the order the leaves reach them. The scene's
+tree sees the mesh as a single shape, and the mesh's own walk takes over once a ray gets to it.
+Every triangle still has an id of its own (the mesh's id + its index), so a mesh shadows itself just as loose triangles would;
+only the triangle being shaded is left out of its shadow rays.
+Triangles use the same watertight test as the triangle table, and neighbours share their vertices exactly, so nothing slips
+between them.
+==================================================================================================
+*/
+
+class TriangleMesh : public Shape {
+    private:
+        std::vector<float> positions;   //xyz per vertex
+        std::vector<float> normals;     //xyz per normal
+        std::vector<float> uvs;         //uv per texture coordinate
+        std::vector<int> vertexIndices; //3 per triangle, in leaf order
+        std::vector<int> normalIndices; //3 per triangle, or empty if the mesh has no normals; -1 where a face has none
+        std::vector<int> uvIndices;     //likewise for texture coordinates
+        std::vector<LinearBVHNode> nodes;
+        int maxDepth;
+        vector3 minimums;
+        vector3 maximums;
+
+        vector3 position (int vertex) const {
+            return {positions[3 * vertex], positions[3 * vertex + 1], positions[3 * vertex + 2]};
+        }
+
+        double hitTriangle (int triangle, const Ray& ray, double* weights = nullptr) const {
+            double v[3][3];
+            for (int i = 0; i < 3; i++) {
+                const float* p = &positions[3 * vertexIndices[3 * triangle + i]];
+                for (int a = 0; a < 3; a++) { v[i][a] = p[a]; }
+            }
+            return watertightHitDistance(v, ray, weights);
+        }
+
+        /*
+        Walks the mesh's tree (nearer child first, as findClosestFrom() does) for the closest triangle, or just any triangle if
+        anyHit; the triangle numbered skip is never hit. Returns the triangle (or -1), and leaves the ray's tMax at its hit
+        */
+        int walk (Ray& ray, bool anyHit, int skip = -1) const {
+            int stackBuffer[BVH_STACK_SIZE];
+            std::vector<int> bigStack;
+            int* stack = stackBuffer;
+            if (maxDepth >= BVH_STACK_SIZE) {
+                bigStack.resize(maxDepth + 1);
+                stack = bigStack.data();
+            }
+            int stackSize = 0;
+            int index = 0;
+            int closest = -1;
+
+            while (true) {
+                const LinearBVHNode& node = nodes[index];
+
+                if (node.intersect(ray)) {
+                    if (node.primCount > 0) {
+                        for (int i = node.offset; i < node.offset + node.primCount; i++) {
+                            if (i == skip) { continue; }
+                            double t = hitTriangle(i, ray);
+                            if (t >= 0 && (closest < 0 || t < ray.getTMax())) { //ties go to the triangle found first
+                                ray.setTMax(t);
+                                closest = i;
+                                if (anyHit) { return closest; }
+                            }
+                        }
+                    }
+                    else {
+                        if (ray.getSign(node.axis)) {
+                            stack[stackSize++] = index + 1;
+                            index = node.offset;
+                        }
+                        else {
+                            stack[stackSize++] = node.offset;
+                            index = index + 1;
+                        }
+                        continue;
+                    }
+                }
+
+                if (stackSize == 0) { break; }
+                index = stack[--stackSize];
+            }
+
+            return closest;
+        }
+
+        int flatten (BVHNode* node, const std::vector<BVHPrimitive>& prims, int depth) {
+            int index = nodes.size();
+            maxDepth = std::max(maxDepth, depth);
+            nodes.push_back(LinearBVHNode());
+
+            LinearBVHNode linear;
+            LinearBVH::setBounds(linear, node->bounds.getMinimums(), node->bounds.getMaximums());
+            if (node->isLeaf()) {
+                linear.offset = node->firstPrim; //the triangles are put in prims' order afterwards, so the leaf's range carries over
+                linear.primCount = node->primCount;
+                linear.axis = 0;
+            }
+            else {
+                linear.primCount = 0;
+                linear.axis = node->axis;
+                flatten(node->left, prims, depth + 1);
+                linear.offset = flatten(node->right, prims, depth + 1);
+            }
+
+            nodes[index] = linear;
+            return index;
+        }
+
+    public:
+        //takes the mesh's arrays (indices are 0 based) and builds its tree; id is the first of the ids its triangles take up
+        TriangleMesh (std::vector<float> p, std::vector<float> n, std::vector<float> t, std::vector<int> vi, std::vector<int> ni,
+                      std::vector<int> ti, Material m, int id) : Shape(m, id), positions(std::move(p)), normals(std::move(n)),
+                      uvs(std::move(t)), vertexIndices(std::move(vi)), normalIndices(std::move(ni)), uvIndices(std::move(ti)), maxDepth(0) {
+            int count = size();
+            minimums = {INFINITY, INFINITY, INFINITY};
+            maximums = {-INFINITY, -INFINITY, -INFINITY};
+            if (count == 0) { return; }
+
+            std::vector<BVHPrimitive> prims;
+            prims.reserve(count);
+            for (int i = 0; i < count; i++) {
+                vector3 mi = position(vertexIndices[3 * i]);
+                vector3 ma = mi;
+                for (int c = 1; c < 3; c++) {
+                    mi = vectMin(mi, position(vertexIndices[3 * i + c]));
+                    ma = vectMax(ma, position(vertexIndices[3 * i + c]));
+                }
+                prims.push_back(BVHPrimitive(nullptr, i, mi, ma));
+                minimums = vectMin(minimums, mi);
+                maximums = vectMax(maximums, ma);
+            }
+
+            BVHNode* root = buildSAHBVH(prims, 0, count - 1, BVH_MAX_LEAF_SIZE, bvhThreadDepth());
+            flatten(root, prims, 0);
+            deleteBVH(root);
+
+            //put the triangles in leaf order
+            auto permute = [&](std::vector<int>& indices) {
+                if (indices.empty()) { return; }
+                std::vector<int> moved(indices.size());
+                for (int i = 0; i < count; i++) {
+                    for (int c = 0; c < 3; c++) { moved[3 * i + c] = indices[3 * prims[i].index + c]; }
+                }
+                indices.swap(moved);
+            };
+            permute(vertexIndices);
+            permute(normalIndices);
+            permute(uvIndices);
+        }
+
+        int size () const { return vertexIndices.size() / 3; }
+        int vertexCount () const { return positions.size() / 3; }
+        size_t memoryBytes () const {
+            return (positions.size() + normals.size() + uvs.size()) * sizeof(float)
+                 + (vertexIndices.size() + normalIndices.size() + uvIndices.size()) * sizeof(int) + nodes.size() * sizeof(LinearBVHNode);
+        }
+
+        std::string getType () override { return "trianglemesh"; }
+        int idCount () override { return size(); }
+        vector3 getMinimums () override { return minimums; }
+        vector3 getMaximums () override { return maximums; }
+        vector3 getCenter () override { return (minimums + maximums) * 0.5; }
+
+        double hitDistance (Ray& ray) override {
+            if (nodes.empty()) { return -1; }
+            double tMax = ray.getTMax();
+            double t = (walk(ray, false) >= 0) ? ray.getTMax() : -1;
+            ray.setTMax(tMax);
+            return t;
+        }
+
+        //the triangle with id ignoreID (if it's one of ours) is the one being shaded, and can't shadow itself
+        bool occludes (Ray& ray, int ignoreID, int /*ignoreInstanceID*/ = -1) override {
+            if (nodes.empty()) { return false; }
+            int skip = (ignoreID >= id && ignoreID < id + size()) ? ignoreID - id : -1;
+            double tMax = ray.getTMax();
+            bool blocked = walk(ray, true, skip) >= 0;
+            ray.setTMax(tMax);
+            return blocked;
+        }
+
+        //shading normals & texture coordinates are blended across the triangle from its vertices', where it has them
+        Hit intersect (Ray& ray, const std::list<LightSource*>& l, vector3 camLook, bool calcMaterial = true) override {
+            if (nodes.empty()) { return Hit(); }
+            double tMax = ray.getTMax();
+            int triangle = walk(ray, false);
+            double t = ray.getTMax();
+            ray.setTMax(tMax);
+            if (triangle < 0) { return Hit(); }
+
+            double weights[3];
+            hitTriangle(triangle, ray, weights);
+            const int* vi = &vertexIndices[3 * triangle];
+            vector3 v0 = position(vi[0]);
+            vector3 normal = vectNormalize(crossProduct(position(vi[1]) - v0, position(vi[2]) - v0));
+            const int* ni = normalIndices.empty() ? nullptr : &normalIndices[3 * triangle];
+            if (ni && ni[0] >= 0 && ni[1] >= 0 && ni[2] >= 0) {
+                vector3 blended;
+                for (int c = 0; c < 3; c++) {
+                    const float* n = &normals[3 * ni[c]];
+                    blended = blended + vector3{n[0], n[1], n[2]} * weights[c];
+                }
+                if (blended.magnitude() > 0) { normal = vectNormalize(blended); }
+            }
+
+            vector3 intersectionPoint = ray.at(t);
+            Hit hit = Hit(t, intersectionPoint, normal, vector3{0,0,0}, id + triangle, material.getReflectivity(), material.getRefIndex());
+
+            //texture coordinates wrap, with v running up the image
+            const int* ti = uvIndices.empty() ? nullptr : &uvIndices[3 * triangle];
+            if (material.exists() && material.hasTexture() && ti && ti[0] >= 0 && ti[1] >= 0 && ti[2] >= 0) {
+                double u = 0;
+                double v = 0;
+                for (int c = 0; c < 3; c++) {
+                    u += uvs[2 * ti[c]] * weights[c];
+                    v += uvs[2 * ti[c] + 1] * weights[c];
+                }
+                Image& tex = material.getTexture();
+                u -= std::floor(u);
+                v -= std::floor(v);
+                hit.setTexCoords({std::min(u * tex.getWidth(), tex.getWidth() - 1.0), std::min((1 - v) * tex.getHeight(), tex.getHeight() - 1.0), 0});
+            }
+
+            if (calcMaterial) { shade(hit, l, camLook); }
+            return hit;
+        }
+};
+
+/*
+Reads a Wavefront .obj file into a TriangleMesh; returns nullptr if the file can't be read or has no faces.
+Only the geometry is read - v, vt, vn & f lines (faces with more than three corners are split into a fan); materials, groups &
+everything else are skipped, and the whole mesh takes material m. transform is applied to every vertex (& normal) as it's read.
+*/
+TriangleMesh* readOBJ (const std::string& filename, Material m, int id, const matrix4& transform, bool print = true) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error opening OBJ file " << filename << std::endl;
+        return nullptr;
+    }
+
+    matrix4 normalTransform = mat4Transpose(mat4AffineInverse(transform));
+    std::vector<float> positions, normals, uvs;
+    std::vector<int> vertexIndices, normalIndices, uvIndices;
+    bool hasNormals = false;
+    bool hasUVs = false;
+    int skipped = 0; //faces referencing data that isn't there
+
+    //one corner of a face: v, v/t, v//n or v/t/n; indices count from 1, or back from the end if negative. 0 if absent
+    auto readCorner = [](const char*& c, long corner[3]) {
+        for (int k = 0; k < 3; k++) { corner[k] = 0; }
+        char* end;
+        corner[0] = std::strtol(c, &end, 10);
+        if (end == c) { return false; }
+        c = end;
+        for (int k = 1; k < 3 && *c == '/'; k++) {
+            c++;
+            corner[k] = std::strtol(c, &end, 10);
+            c = end;
+        }
+        return true;
+    };
+    //resolves an index read from the file against count entries so far; -1 if it's out of range
+    auto resolve = [](long index, int count) {
+        long resolved = (index < 0) ? count + index : index - 1;
+        return (resolved >= 0 && resolved < count) ? (int) resolved : -1;
+    };
+
+    std::string line;
+    std::vector<long> face; //corners of the current face, 3 numbers each
+    while (std::getline(file, line)) {
+        const char* c = line.c_str();
+        while (*c == ' ' || *c == '\t') { c++; }
+
+        if (c[0] == 'v' && (c[1] == ' ' || c[1] == '\t')) {
+            double p[3] = {0, 0, 0};
+            char* end;
+            c++;
+            for (int a = 0; a < 3; a++) { p[a] = std::strtod(c, &end); c = end; }
+            vector3 v = transformPoint(transform, {p[0], p[1], p[2]});
+            for (int a = 0; a < 3; a++) { positions.push_back((float) v.atr[a]); }
+        }
+        else if (c[0] == 'v' && c[1] == 'n') {
+            double n[3] = {0, 0, 0};
+            char* end;
+            c += 2;
+            for (int a = 0; a < 3; a++) { n[a] = std::strtod(c, &end); c = end; }
+            vector3 v = transformDirection(normalTransform, {n[0], n[1], n[2]});
+            if (v.magnitude() > 0) { v = vectNormalize(v); }
+            for (int a = 0; a < 3; a++) { normals.push_back((float) v.atr[a]); }
+        }
+        else if (c[0] == 'v' && c[1] == 't') {
+            char* end;
+            c += 2;
+            double u = std::strtod(c, &end); c = end;
+            double v = std::strtod(c, &end);
+            uvs.push_back((float) u);
+            uvs.push_back((float) v);
+        }
+        else if (c[0] == 'f' && (c[1] == ' ' || c[1] == '\t')) {
+            c++;
+            face.clear();
+            long corner[3];
+            while (true) {
+                while (*c == ' ' || *c == '\t') { c++; }
+                if (!readCorner(c, corner)) { break; }
+                for (int k = 0; k < 3; k++) { face.push_back(corner[k]); }
+            }
+
+            int vertexCount = positions.size() / 3;
+            int uvCount = uvs.size() / 2;
+            int normalCount = normals.size() / 3;
+            for (int i = 2; i < (int) face.size() / 3; i++) {
+                int corners[3] = {0, i - 1, i};
+                int v[3], t[3], n[3];
+                bool valid = true;
+                for (int k = 0; k < 3; k++) {
+                    const long* fc = &face[3 * corners[k]];
+                    v[k] = resolve(fc[0], vertexCount);
+                    t[k] = fc[1] ? resolve(fc[1], uvCount) : -1;
+                    n[k] = fc[2] ? resolve(fc[2], normalCount) : -1;
+                    valid = valid && v[k] >= 0;
+                }
+                if (!valid) {
+                    skipped++;
+                    continue;
+                }
+                for (int k = 0; k < 3; k++) {
+                    vertexIndices.push_back(v[k]);
+                    uvIndices.push_back(t[k]);
+                    normalIndices.push_back(n[k]);
+                    hasUVs = hasUVs || t[k] >= 0;
+                    hasNormals = hasNormals || n[k] >= 0;
+                }
+            }
+        }
+    }
+    file.close();
+
+    if (skipped > 0) { std::cerr << "Skipped " << skipped << " faces of " << filename << " with missing vertices." << std::endl; }
+    if (vertexIndices.empty()) {
+        std::cerr << "OBJ file " << filename << " has no faces; skipping it." << std::endl;
+        return nullptr;
+    }
+    if (!hasNormals) { normals.clear(); normalIndices.clear(); }
+    if (!hasUVs) { uvs.clear(); uvIndices.clear(); }
+
+    auto buildStart = std::chrono::steady_clock::now();
+    //the arrays grew as they were read; trim the slack before they're handed over
+    for (std::vector<float>* v : {&positions, &normals, &uvs}) { v->shrink_to_fit(); }
+    for (std::vector<int>* v : {&vertexIndices, &normalIndices, &uvIndices}) { v->shrink_to_fit(); }
+    TriangleMesh* mesh = new TriangleMesh(std::move(positions), std::move(normals), std::move(uvs), std::move(vertexIndices),
+                                          std::move(normalIndices), std::move(uvIndices), m, id);
+    if (print) {
+        std::cout << "Loaded " << filename << " : " << mesh->size() << " triangles, " << mesh->vertexCount() << " vertices, "
+                  << mesh->memoryBytes() / 1024.0 << " KB (tree built in " << nanosecondsSince(buildStart) * 1e-9 << "s)" << std::endl;
+    }
+    return mesh;
+}
+
+#endif
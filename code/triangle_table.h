@@ -0,0 +1,127 @@
+#ifndef TRIANGLE_TABLE_H
+#define TRIANGLE_TABLE_H
+
+#include <cmath>
+#include <type_traits>
+#include <vector>
+#include "vector_helper.h"
+#include "ray.h"
+
+/*
+==================================================================================================
+Triangle table: the data the triangle tests need, worked out once at scene load rather than for every ray.
+Each triangle gets a slot; the vertices & unit face normals of every slot are kept in structure-of-arrays form (one array per
+component). Once the acceleration structure is built the slots are put in the order its leaves reach them, so the few triangles
+a leaf tests sit side by side in every array, rather than wherever they happened to be loaded. Triangles hold on to the handle
+they were added with, which never changes; the table looks their current slot up from it.
+
+The test is the watertight one from Woop, Benthin & Wald ("Watertight Ray/Triangle Intersection", JCGT 2013).
+The ray's shear (worked out once in Ray) maps it onto the +z axis, and the vertices are moved the same way; the hit is then a
+2D edge test in x & y. Two triangles sharing an edge run exactly the same sums for it (with opposite signs), so a ray through
+the edge always hits one of them - no cracks along shared edges, and no help needed from nudged rays.
+==================================================================================================
+*/
+
+// The test itself, for the triangle with vertices[i][axis]: the distance along the ray, or -1 on a miss (or a hit outside the
+// ray's interval); both sides count. Given weights, it also writes the barycentric weights of the three vertices at the hit
+inline double watertightHitDistance (const double vertices[3][3], const Ray& ray, double* weights = nullptr) {
+    int kx = ray.getShearAxis(0);
+    int ky = ray.getShearAxis(1);
+    int kz = ray.getShearAxis(2);
+    double sx = ray.getShear(0);
+    double sy = ray.getShear(1);
+    double sz = ray.getShear(2);
+    vector3 origin = ray.getOrigin();
+
+    //vertices relative to the ray origin, sheared so the ray runs down +z
+    double x[3], y[3], z[3];
+    for (int i = 0; i < 3; i++) {
+        double rz = vertices[i][kz] - origin.atr[kz];
+        x[i] = (vertices[i][kx] - origin.atr[kx]) - sx * rz;
+        y[i] = (vertices[i][ky] - origin.atr[ky]) - sy * rz;
+        z[i] = sz * rz;
+    }
+
+    //scaled barycentrics; the ray is inside if they share a sign (zeros are on an edge, which counts)
+    double u = x[2] * y[1] - y[2] * x[1];
+    double v = x[0] * y[2] - y[0] * x[2];
+    double w = x[1] * y[0] - y[1] * x[0];
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) { return -1; }
+
+    double det = u + v + w;
+    if (det == 0) { return -1; } //ray lies in the triangle's plane
+
+    double t = (u * z[0] + v * z[1] + w * z[2]) / det;
+    if (!ray.inInterval(t)) { return -1; }
+    if (weights) {
+        weights[0] = u / det;
+        weights[1] = v / det;
+        weights[2] = w / det;
+    }
+    return t;
+}
+
+class TriangleTable {
+    public:
+        std::vector<double> vertex[3][3]; //vertex[v][axis][slot]
+        std::vector<double> normal[3];    //normal[axis][slot], unit length; what the shading uses
+        std::vector<int> slots;           //slots[handle], the slot the triangle added with handle is in now
+        std::vector<int> handles;         //handles[slot], the handle of the triangle in slot; the other way round
+
+        // Stores a triangle's vertices and normal; returns the handle to find them by, through slotOf(), however they're reordered
+        int add (const vector3& v0, const vector3& v1, const vector3& v2) {
+            const vector3* v[3] = {&v0, &v1, &v2};
+            for (int i = 0; i < 3; i++) {
+                for (int a = 0; a < 3; a++) { vertex[i][a].push_back(v[i]->atr[a]); }
+            }
+            vector3 n = vectNormalize(crossProduct(v1 - v0, v2 - v0));
+            for (int a = 0; a < 3; a++) { normal[a].push_back(n.atr[a]); }
+            int handle = (int) slots.size();
+            slots.push_back(handle);
+            handles.push_back(handle);
+            return handle;
+        }
+
+        int slotOf (int handle) const { return slots[handle]; }
+
+        // Moves the data of slot order[i] to slot i; slots missing from order follow on in their current order
+        void reorder (const std::vector<int>& order) {
+            std::vector<int> from;
+            from.reserve(size());
+            std::vector<bool> placed(size(), false);
+            for (int slot : order) {
+                if (!placed[slot]) { placed[slot] = true; from.push_back(slot); }
+            }
+            for (int slot = 0; slot < size(); slot++) {
+                if (!placed[slot]) { from.push_back(slot); }
+            }
+
+            auto permute = [&](auto& values) {
+                std::decay_t<decltype(values)> moved(values.size());
+                for (int i = 0; i < (int) from.size(); i++) { moved[i] = values[from[i]]; }
+                values.swap(moved);
+            };
+            for (int i = 0; i < 3; i++) {
+                for (int a = 0; a < 3; a++) { permute(vertex[i][a]); }
+            }
+            for (int a = 0; a < 3; a++) { permute(normal[a]); }
+            permute(handles);
+            for (int slot = 0; slot < size(); slot++) { slots[handles[slot]] = slot; }
+        }
+
+        int size () const { return (int) normal[0].size(); }
+        size_t memoryBytes () const { return (size_t) size() * (12 * sizeof(double) + 2 * sizeof(int)); }
+
+        vector3 getNormal (int slot) const { return {normal[0][slot], normal[1][slot], normal[2][slot]}; }
+
+        //distance along the ray to the triangle in slot, or -1 on a miss (or a hit outside the ray's interval); both sides count
+        double hitDistance (int slot, const Ray& ray) const {
+            double v[3][3];
+            for (int i = 0; i < 3; i++) {
+                for (int a = 0; a < 3; a++) { v[i][a] = vertex[i][a][slot]; }
+            }
+            return watertightHitDistance(v, ray);
+        }
+};
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef UNIFORM_GRID_H
+#define UNIFORM_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <vector>
+#include "vector_helper.h"
+#include "shape.h"
+#include "ray.h"
+#include "acceleration hierarchy.h"
+
+/*
+==================================================================================================
+Uniform grid: an alternative to the BVH for big "soups" of similar sized shapes (particles, sphere piles from jsonmaker.py).
+The scene box is cut into equal cells, and every cell lists the shapes whose boxes overlap it. Rays step from cell to cell in
+order (3D-DDA) and can stop at the first cell holding a hit, so there's no tree to descend and no stack to keep; but a grid
+copes badly with shapes of very different sizes (big ones land in lots of cells, small ones crowd a few), which is what the
+"auto" choice in gridSuitsScene() & gridWorthKeeping() looks at.
+It answers the same queries as the BVHs (findClosest, intersectBVH, findOccluder), so the renderer doesn't care which it has.
+==================================================================================================
+*/
+
+const double GRID_DENSITY = 2.0;            //cells per shape (before rounding to the box's proportions)
+const int GRID_MAX_RESOLUTION = 512;        //per axis
+const long long GRID_MAX_CELLS = 1 << 24;   //~64MB of cell offsets
+const int GRID_AUTO_MIN_SHAPES = 4096;      //below this, the BVH is too quick for it to matter
+const double GRID_AUTO_MAX_SIZE_VARIATION = 0.5; //"auto" wants the shapes' sizes within this coefficient of variation...
+const double GRID_AUTO_MAX_SIZE_RATIO = 8;        //...and no shape more than this many times the average size
+const double GRID_AUTO_MAX_REFERENCES = 8;        //once built, "auto" drops a grid whose shapes average more cells than this each
+const int GRID_MAILBOX_SIZE = 8;            //shapes spanning several cells are remembered so they aren't tested again
+
+class UniformGrid {
+    public:
+        vector3 minimums;
+        vector3 maximums;
+        int resolution[3];
+        vector3 cellSize;
+        std::vector<uint32_t> cellStart; //cell c holds cellPrims[cellStart[c] .. cellStart[c + 1])
+        std::vector<Shape*> cellPrims;
+
+        UniformGrid (const std::vector<Shape*>& shapes, double density = GRID_DENSITY) {
+            minimums = {INFINITY, INFINITY, INFINITY};
+            maximums = {-INFINITY, -INFINITY, -INFINITY};
+            std::vector<vector3> shapeMin(shapes.size());
+            std::vector<vector3> shapeMax(shapes.size());
+            for (int i = 0; i < (int) shapes.size(); i++) {
+                shapeMin[i] = shapes[i]->getMinimums();
+                shapeMax[i] = shapes[i]->getMaximums();
+                minimums = vectMin(minimums, shapeMin[i]);
+                maximums = vectMax(maximums, shapeMax[i]);
+            }
+            if (shapes.empty()) { minimums = maximums = {0, 0, 0}; }
+
+            //a little padding, like the BVH boxes get, so rays starting on the edge of the scene are still inside it
+            vector3 extent = maximums - minimums;
+            double largest = std::max(extent.x(), std::max(extent.y(), extent.z()));
+            double padding = 1e-3 + largest * 1e-6;
+            minimums = minimums - vector3{padding, padding, padding};
+            maximums = maximums + vector3{padding, padding, padding};
+            extent = maximums - minimums;
+
+            //cells as close to cubes as possible, about density of them per shape
+            double volume = extent.x() * extent.y() * extent.z();
+            double cellsPerUnit = std::cbrt(density * std::max<size_t>(1, shapes.size()) / volume);
+            long long cells;
+            do {
+                cells = 1;
+                for (int a = 0; a < 3; a++) {
+                    resolution[a] = std::clamp((int) std::ceil(extent.atr[a] * cellsPerUnit), 1, GRID_MAX_RESOLUTION);
+                    cells *= resolution[a];
+                }
+                cellsPerUnit *= 0.9;
+            } while (cells > GRID_MAX_CELLS);
+            for (int a = 0; a < 3; a++) { cellSize.atr[a] = extent.atr[a] / resolution[a]; }
+
+            //count what goes in each cell, turn the counts into offsets, then drop the shapes in
+            cellStart.assign(cells + 1, 0);
+            for (int i = 0; i < (int) shapes.size(); i++) {
+                forEachCell(shapeMin[i], shapeMax[i], [&](int cell) { cellStart[cell + 1]++; });
+            }
+            for (long long c = 0; c < cells; c++) { cellStart[c + 1] += cellStart[c]; }
+            cellPrims.resize(cellStart[cells]);
+            std::vector<uint32_t> cursor(cellStart.begin(), cellStart.end() - 1);
+            for (int i = 0; i < (int) shapes.size(); i++) {
+                forEachCell(shapeMin[i], shapeMax[i], [&](int cell) { cellPrims[cursor[cell]++] = shapes[i]; });
+            }
+        }
+
+        int cellCount () const { return resolution[0] * resolution[1] * resolution[2]; }
+        int cellIndex (int x, int y, int z) const { return (z * resolution[1] + y) * resolution[0] + x; }
+        size_t memoryBytes () const { return cellStart.size() * sizeof(uint32_t) + cellPrims.size() * sizeof(Shape*); }
+
+        //the cell along axis a holding coordinate v; clamped, so points just outside the grid use the edge cells
+        int cellCoordinate (double v, int a) const {
+            return std::clamp((int) ((v - minimums.atr[a]) / cellSize.atr[a]), 0, resolution[a] - 1);
+        }
+
+    private:
+        template <typename Body>
+        void forEachCell (const vector3& mi, const vector3& ma, Body body) {
+            int lo[3];
+            int hi[3];
+            for (int a = 0; a < 3; a++) {
+                lo[a] = cellCoordinate(mi.atr[a], a);
+                hi[a] = cellCoordinate(ma.atr[a], a);
+            }
+            for (int z = lo[2]; z <= hi[2]; z++) {
+                for (int y = lo[1]; y <= hi[1]; y++) {
+                    for (int x = lo[0]; x <= hi[0]; x++) { body(cellIndex(x, y, z)); }
+                }
+            }
+        }
+};
+
+/*
+"auto" picks the grid when there are plenty of shapes and they're all about the same size; measured by the spread of the
+diagonals of their boxes. Anything else (a ground plane under the particles, a mix of big & small objects) stays on the BVH.
+*/
+bool gridSuitsScene (const std::vector<Shape*>& shapes, double& sizeVariation) {
+    sizeVariation = 0;
+    if ((int) shapes.size() < GRID_AUTO_MIN_SHAPES) { return false; }
+
+    double sum = 0;
+    double sumSquares = 0;
+    double largest = 0;
+    for (Shape* s : shapes) {
+        double size = (s->getMaximums() - s->getMinimums()).magnitude();
+        sum += size;
+        sumSquares += size * size;
+        largest = std::max(largest, size);
+    }
+    double mean = sum / shapes.size();
+    if (mean <= 0) { return false; }
+    double variance = std::max(0.0, sumSquares / shapes.size() - mean * mean);
+    sizeVariation = std::sqrt(variance) / mean;
+    return sizeVariation <= GRID_AUTO_MAX_SIZE_VARIATION && largest <= GRID_AUTO_MAX_SIZE_RATIO * mean;
+}
+
+// Shapes can all be the same size and still be bad for a grid: long thin ones cross dozens of cells each, & every ray
+// through those cells tests them. That only shows once the grid is built, so "auto" checks this afterwards.
+bool gridWorthKeeping (const UniformGrid* grid, int shapeCount) {
+    return shapeCount > 0 && grid->cellPrims.size() <= GRID_AUTO_MAX_REFERENCES * shapeCount;
+}
+
+/*
+3D-DDA walk over the cells a ray passes through within its tMin - tMax, nearest first.
+visitCell(first, last, tExit) is handed each cell's shapes and the distance at which the ray leaves the cell, and returns
+true to stop the walk there.
+*/
+template <typename VisitCell>
+void walkGrid (const UniformGrid* grid, const Ray& ray, VisitCell visitCell) {
+    vector3 origin = ray.getOrigin();
+    vector3 dir = ray.getDirection();
+    const vector3& invDirection = ray.getInvDirection();
+
+    //clip the ray to the grid box; NaNs from rays lying in a face are ignored, as in the BVH slab tests
+    double tEnter = ray.getTMin();
+    double tLeave = ray.getTMax();
+    for (int a = 0; a < 3; a++) {
+        double t0 = ((ray.getSign(a) ? grid->maximums : grid->minimums).atr[a] - origin.atr[a]) * invDirection.atr[a];
+        double t1 = ((ray.getSign(a) ? grid->minimums : grid->maximums).atr[a] - origin.atr[a]) * invDirection.atr[a];
+        if (t0 > tEnter) { tEnter = t0; }
+        if (t1 < tLeave) { tLeave = t1; }
+    }
+    if (tLeave < tEnter) { return; }
+
+    vector3 start = origin + dir * tEnter;
+    int cell[3];
+    int step[3];
+    double tNext[3];  //distance to the next cell boundary along each axis
+    double tDelta[3]; //distance between boundaries along each axis
+    for (int a = 0; a < 3; a++) {
+        cell[a] = grid->cellCoordinate(start.atr[a], a);
+        if (dir.atr[a] > 0) {
+            step[a] = 1;
+            tNext[a] = (grid->minimums.atr[a] + (cell[a] + 1) * grid->cellSize.atr[a] - origin.atr[a]) * invDirection.atr[a];
+            tDelta[a] = grid->cellSize.atr[a] * invDirection.atr[a];
+        }
+        else if (dir.atr[a] < 0) {
+            step[a] = -1;
+            tNext[a] = (grid->minimums.atr[a] + cell[a] * grid->cellSize.atr[a] - origin.atr[a]) * invDirection.atr[a];
+            tDelta[a] = -grid->cellSize.atr[a] * invDirection.atr[a];
+        }
+        else {
+            step[a] = 0;
+            tNext[a] = INFINITY;
+            tDelta[a] = INFINITY;
+        }
+    }
+
+    while (true) {
+        int axis = (tNext[0] < tNext[1]) ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        int c = grid->cellIndex(cell[0], cell[1], cell[2]);
+        if (visitCell(grid->cellStart[c], grid->cellStart[c + 1], tNext[axis])) { return; }
+        if (tNext[axis] > tLeave) { return; }
+
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= grid->resolution[axis]) { return; }
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+// Small per-ray memory of the shapes already tested; a hash collision only costs a repeat test
+struct GridMailbox {
+    Shape* recent[GRID_MAILBOX_SIZE] = {};
+
+    //true if s was tested already; otherwise remembers it
+    bool seen (Shape* s) {
+        int slot = (int) ((reinterpret_cast<uintptr_t>(s) >> 4) % GRID_MAILBOX_SIZE);
+        if (recent[slot] == s) { return true; }
+        recent[slot] = s;
+        return false;
+    }
+};
+
+// Closest shape along the ray through the grid; stops at the first cell with a hit inside it (or once past the ray's tMax)
+Shape* findClosest (const UniformGrid* grid, Ray& ray, int& checks) {
+    if (!grid || grid->cellPrims.empty()) { return nullptr; }
+
+    Shape* closestShape = nullptr;
+    GridMailbox mailbox;
+    walkGrid(grid, ray, [&](uint32_t first, uint32_t last, double tExit) {
+        checks++;
+        for (uint32_t i = first; i < last; i++) {
+            Shape* s = grid->cellPrims[i];
+            if (mailbox.seen(s)) { continue; }
+            double t = s->hitDistance(ray);
+            if (t >= 0 && (!closestShape || t < ray.getTMax())) {
+                ray.setTMax(t);
+                closestShape = s;
+            }
+        }
+        return ray.getTMax() <= tExit; //a hit further on could still be beaten by one in the next cell
+    });
+    return closestShape;
+}
+
+// Closest hit through the grid; same rules as the binary intersectBVH
+Hit intersectBVH(Ray& ray, const std::list<LightSource*>& l, const vector3& look, const UniformGrid* grid, bool calcMaterial = true) {
+    guardSecondaryRay(ray, calcMaterial);
+    int checks = 0;
+    Shape* closestShape = findClosest(grid, ray, checks);
+
+    if (!closestShape) {
+        Hit h = Hit();
+        h.setChecks(std::max(1, checks));
+        return h;
+    }
+
+    Hit h = closestShape->intersect(ray, l, look, calcMaterial);
+    h.setChecks(checks);
+    return h;
+}
+
+// Any-hit shadow query through the grid; same rules as the binary findOccluder
+Shape* findOccluder (const UniformGrid* grid, Ray& ray, int ignoreID, int ignoreInstanceID = -1) {
+    if (!grid || grid->cellPrims.empty()) { return nullptr; }
+
+    Shape* occluder = nullptr;
+    GridMailbox mailbox;
+    walkGrid(grid, ray, [&](uint32_t first, uint32_t last, double /*tExit*/) {
+        for (uint32_t i = first; i < last; i++) {
+            Shape* s = grid->cellPrims[i];
+            if (mailbox.seen(s)) { continue; }
+            if (s->occludes(ray, ignoreID, ignoreInstanceID)) {
+                occluder = s;
+                return true;
+            }
+        }
+        return false;
+    });
+    return occluder;
+}
+
+#endif
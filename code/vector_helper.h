@@ -159,6 +159,15 @@ vector3 vectClamp (vector3 v, double min_d, double max_d) {
     return vector3(x,y,z);
 }
 
+//component-wise minimum / maximum of two vectors; handy for growing bounding boxes
+vector3 vectMin (const vector3& v1, const vector3& v2) {
+    return vector3(std::min(v1.x(), v2.x()), std::min(v1.y(), v2.y()), std::min(v1.z(), v2.z()));
+}
+
+vector3 vectMax (const vector3& v1, const vector3& v2) {
+    return vector3(std::max(v1.x(), v2.x()), std::max(v1.y(), v2.y()), std::max(v1.z(), v2.z()));
+}
+
 //Converts a double vector to a vector of ints in the range of 0 to 255
 //No checking for double in range of 0 to 1 -> unlikely to arise in errors due to structure of prototypical scene json
 //New and improved to deal with vector3 types -> std::vector's have been more or less eliminated now!